@@ -0,0 +1,243 @@
+/**
+ * Runs each benchmark script with an interpreter several times and reports
+ * the minimum, median and spread of the wall-clock times. Given a baseline
+ * saved by an earlier run, it also shows how the medians changed.
+ *
+ *   harness [--runs n] [--baseline file] [--save file] interpreter script...
+ *
+ * The baseline is a flat JSON object from benchmark name to its times in
+ * seconds, which is what --save writes:
+ *
+ *   {
+ *     "fib": {"min": 0.412, "median": 0.418, "stddev": 0.003},
+ *     ...
+ *   }
+ *
+ * Every benchmark runs once untimed first, to warm up caches. A benchmark
+ * that exits with an error fails the whole harness.
+ *
+ * Run with `make bench` and `make bench-baseline`.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS_DEFAULT 5
+#define NAME_MAX_LENGTH 64
+#define BASELINE_MAX 256
+
+typedef struct {
+    char name[NAME_MAX_LENGTH];
+    double min;
+    double median;
+    double stddev;
+} Result;
+
+static Result baseline[BASELINE_MAX];
+static int baselineCount = 0;
+
+static double seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs the script once with its output discarded. Returns the time taken,
+// or a negative number if it failed.
+static double runOnce(const char* interpreter, const char* script) {
+    double start = seconds();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execl(interpreter, interpreter, script, (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    double elapsed = seconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    return elapsed;
+}
+
+static int compareTimes(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// "bench/fib.lox" is called "fib".
+static void benchmarkName(const char* script, char* name) {
+    const char* start = strrchr(script, '/');
+    start = start == NULL ? script : start + 1;
+    size_t length = strcspn(start, ".");
+    if (length >= NAME_MAX_LENGTH) length = NAME_MAX_LENGTH - 1;
+    memcpy(name, start, length);
+    name[length] = '\0';
+}
+
+/**
+ * Reads a file written by saveBaseline(). It isn't a general JSON parser:
+ * it expects one benchmark per line, as saveBaseline() writes them.
+ */
+static bool loadBaseline(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL &&
+           baselineCount < BASELINE_MAX) {
+        Result* result = &baseline[baselineCount];
+        if (sscanf(line,
+                   " \"%63[^\"]\": {\"min\": %lf, \"median\": %lf, \"stddev\": %lf}",
+                   result->name, &result->min, &result->median,
+                   &result->stddev) == 4) {
+            baselineCount++;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static bool saveBaseline(const char* path, Result* results, int count) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "{\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "  \"%s\": {\"min\": %.6f, \"median\": %.6f, \"stddev\": %.6f}%s\n",
+                results[i].name, results[i].min, results[i].median,
+                results[i].stddev, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "}\n");
+    fclose(file);
+    return true;
+}
+
+static Result* findBaseline(const char* name) {
+    for (int i = 0; i < baselineCount; i++) {
+        if (strcmp(baseline[i].name, name) == 0) return &baseline[i];
+    }
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: harness [--runs n] [--baseline file] [--save file] "
+                    "interpreter script...\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    int runs = RUNS_DEFAULT;
+    const char* baselinePath = NULL;
+    const char* savePath = NULL;
+
+    int arg = 1;
+    while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--runs") == 0) {
+            runs = atoi(argv[arg + 1]);
+            if (runs < 1) usage();
+        } else if (strcmp(argv[arg], "--baseline") == 0) {
+            baselinePath = argv[arg + 1];
+        } else if (strcmp(argv[arg], "--save") == 0) {
+            savePath = argv[arg + 1];
+        } else {
+            usage();
+        }
+        arg += 2;
+    }
+    if (argc - arg < 2) usage();
+
+    const char* interpreter = argv[arg++];
+    int count = argc - arg;
+
+    bool compare = baselinePath != NULL && loadBaseline(baselinePath);
+    if (baselinePath != NULL && !compare) {
+        printf("No baseline in %s yet; run make bench-baseline first.\n\n",
+               baselinePath);
+    }
+
+    Result* results = calloc(count, sizeof(Result));
+    double* times = malloc(sizeof(double) * runs);
+    if (results == NULL || times == NULL) exit(1);
+
+    printf("%-16s %9s %9s %8s", "benchmark", "min", "median", "stddev");
+    if (compare) printf(" %9s %8s", "baseline", "change");
+    printf("\n");
+
+    bool failed = false;
+    for (int i = 0; i < count; i++) {
+        const char* script = argv[arg + i];
+        Result* result = &results[i];
+        benchmarkName(script, result->name);
+
+        if (runOnce(interpreter, script) < 0) {
+            printf("%-16s failed\n", result->name);
+            failed = true;
+            continue;
+        }
+
+        double sum = 0;
+        bool runFailed = false;
+        for (int run = 0; run < runs; run++) {
+            times[run] = runOnce(interpreter, script);
+            if (times[run] < 0) {
+                runFailed = true;
+                break;
+            }
+            sum += times[run];
+        }
+        if (runFailed) {
+            printf("%-16s failed\n", result->name);
+            failed = true;
+            continue;
+        }
+
+        qsort(times, runs, sizeof(double), compareTimes);
+        double mean = sum / runs;
+        double squares = 0;
+        for (int run = 0; run < runs; run++) {
+            squares += (times[run] - mean) * (times[run] - mean);
+        }
+
+        result->min = times[0];
+        result->median = runs % 2 == 1
+            ? times[runs / 2]
+            : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+        result->stddev = runs > 1 ? sqrt(squares / (runs - 1)) : 0;
+
+        printf("%-16s %8.3fs %8.3fs %7.1f%%", result->name, result->min,
+               result->median, 100 * result->stddev / mean);
+        Result* before = compare ? findBaseline(result->name) : NULL;
+        if (before != NULL) {
+            printf(" %8.3fs %+7.1f%%", before->median,
+                   100 * (result->median - before->median) / before->median);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (savePath != NULL && !failed) {
+        if (!saveBaseline(savePath, results, count)) {
+            fprintf(stderr, "Could not write %s.\n", savePath);
+            failed = true;
+        } else {
+            printf("\nSaved as the baseline in %s.\n", savePath);
+        }
+    }
+
+    free(times);
+    free(results);
+    return failed ? 70 : 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * Times keyword recognition: the perfect hash in scanner.c against the trie
+ * of checkKeyword() calls it replaced, which is kept here. Both classify
+ * the same mix of keywords and identifiers; they must agree on every one.
+ *
+ * Run with `make bench-keywords`.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+// For the static identifierType() and scanner state.
+#include "../scanner.c"
+
+#define ROUNDS 20000
+#define SEQUENCE_LENGTH 4096
+
+static TokenType checkKeyword(int start, int length, const char* rest,
+                              TokenType type) {
+    if (scanner.current - scanner.start == start + length &&
+        memcmp(scanner.start + start, rest, length) == 0) {
+        return type;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+static TokenType trieIdentifierType() {
+    switch (scanner.start[0]) {
+        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
+        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        case 'f':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
+                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+                }
+            }
+            break;
+        case 'i':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
+                    case 'n': return checkKeyword(2, 0, "", TOKEN_IN);
+                }
+            }
+            break;
+        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        case 't':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
+                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                }
+            }
+            break;
+        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'y': return checkKeyword(1, 4, "ield", TOKEN_YIELD);
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+// Roughly what the compiler sees: keywords, short locals, and longer names
+// that share a prefix with a keyword.
+static const char* words[] = {
+    "var", "i", "fun", "return", "this", "x", "if", "print", "count",
+    "for", "in", "else", "while", "nil", "true", "false", "and", "or",
+    "class", "super", "yield", "init", "value", "result", "left", "right",
+    "node", "item", "index", "total", "format", "theValue", "variable",
+    "returned", "superclass", "classify", "printer", "truthy", "iffy", "a",
+    "fund", "fo", "n", "whilst", "yielded", "elsewhere", "orange", "nilly",
+};
+
+#define WORD_COUNT ((int)(sizeof(words) / sizeof(words[0])))
+
+static int lengths[WORD_COUNT];
+
+static void selectWord(int i) {
+    scanner.start = words[i];
+    scanner.current = words[i] + lengths[i];
+}
+
+static double seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// The words are looked up in a fixed pseudo-random order so the branch
+// predictor can't learn it.
+static int sequence[SEQUENCE_LENGTH];
+
+static double timeLookups(TokenType (*classify)(), int* checksum) {
+    double start = seconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < SEQUENCE_LENGTH; i++) {
+            selectWord(sequence[i]);
+            *checksum += classify();
+        }
+    }
+    return (seconds() - start) * 1e9 / ((double)ROUNDS * SEQUENCE_LENGTH);
+}
+
+int main() {
+    for (int i = 0; i < WORD_COUNT; i++) {
+        lengths[i] = (int)strlen(words[i]);
+        selectWord(i);
+        if (identifierType() != trieIdentifierType()) {
+            fprintf(stderr, "Disagree on \"%s\".\n", words[i]);
+            return 1;
+        }
+    }
+
+    unsigned int seed = 12345;
+    for (int i = 0; i < SEQUENCE_LENGTH; i++) {
+        seed = seed * 1103515245 + 12345;
+        sequence[i] = (int)((seed >> 16) % WORD_COUNT);
+    }
+
+    // Summing the results keeps the lookups from being optimized away.
+    int checksum = 0;
+    double trie = timeLookups(trieIdentifierType, &checksum);
+    double hash = timeLookups(identifierType, &checksum);
+    printf("trie          %.2f ns/identifier\n", trie);
+    printf("perfect hash  %.2f ns/identifier\n", hash);
+    printf("(checksum %d)\n", checksum);
+    return 0;
+}
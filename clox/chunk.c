@@ -2,19 +2,27 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "shared.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->shared = NULL;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (chunk->shared != NULL) {
+        releaseSharedCode(chunk->shared);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    }
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -24,14 +32,242 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+
+    // The compiler sometimes rewinds `count` to replace instructions it has
+    // already written, which can leave runs past the end behind.
+    while (chunk->lineCount > 0 &&
+           chunk->lines[chunk->lineCount - 1].offset >= chunk->count) {
+        chunk->lineCount--;
+    }
+
+    if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != line) {
+        if (chunk->lineCapacity < chunk->lineCount + 1) {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+            chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+                                      oldCapacity, chunk->lineCapacity);
+        }
+
+        LineStart* start = &chunk->lines[chunk->lineCount++];
+        start->offset = chunk->count;
+        start->line = line;
+    }
+
     chunk->count++;
 }
 
+/**
+ * Returns the source line of the byte at `offset`: the line of the last
+ * run that starts at or before it.
+ */
+int getLine(Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
+/**
+ * Returns the size in bytes of the instruction at `offset`, operands
+ * included, for code that needs to walk a chunk without running it.
+ */
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_BUILD_LIST:
+            return 2;
+        case OP_ADD_LL:
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LL:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LL:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LL:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LL:
+        case OP_LESS_LK:
+        case OP_GREATER_LL:
+        case OP_GREATER_LK:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_ADD_LLL:
+        case OP_ADD_LLK:
+        case OP_SUBTRACT_LLL:
+        case OP_SUBTRACT_LLK:
+        case OP_MULTIPLY_LLL:
+        case OP_MULTIPLY_LLK:
+        case OP_DIVIDE_LLL:
+        case OP_DIVIDE_LLK:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP_LONG:
+        case OP_FOR_LOOP:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            return 4;
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 5;
+        case OP_FOR_LOOP_LONG:
+            return 7;
+        case OP_CLOSURE: {
+            Value constant = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * AS_FUNCTION(constant)->upvalueCount;
+        }
+        case OP_CLOSURE_LONG: {
+            Value constant = chunk->constants.values[readLong(chunk, offset + 1)];
+            return 4 + 4 * AS_FUNCTION(constant)->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Returns how many values the instruction at `offset` leaves on the stack
+ * minus how many it takes off. Quickened forms have the same effect as
+ * their generic ones, so it doesn't matter which one is in the chunk.
+ */
+int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_ADD_LL:
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LL:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LL:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LL:
+        case OP_DIVIDE_LK:
+        case OP_LESS_LL:
+        case OP_LESS_LK:
+        case OP_GREATER_LL:
+        case OP_GREATER_LK:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            return 1;
+        case OP_FOR_PREP:
+            return 2; // The index and the loop variable.
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_GET_INDEX:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_EXIT:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_RANGE:
+            return -1;
+        case OP_SET_INDEX:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_INVOKE_LONG:
+            return -chunk->code[offset + 4];
+        // The superclass is popped as well as the arguments.
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        case OP_SUPER_INVOKE_LONG:
+            return -chunk->code[offset + 4] - 1;
+        case OP_BUILD_LIST:
+            return 1 - chunk->code[offset + 1];
+        default:
+            return 0;
+    }
+}
+
+// Reads the three-byte operand at `offset`.
+int readLong(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+           chunk->code[offset + 2];
+}
+
 int addConstant(Chunk* chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
@@ -4,22 +4,55 @@
 #include "common.h"
 #include "value.h"
 
+/**
+ * Arithmetic and comparison instructions carry a one-byte feedback operand
+ * counting how often the generic form has run. Once it reaches this value
+ * the VM rewrites the opcode in place to a form specialized for the operand
+ * types it sees at that moment (OP_ADD -> OP_ADD_NUM, ...). A specialized
+ * form whose type guard fails rewrites itself back and resets the counter.
+ */
+#define QUICKEN_THRESHOLD 8
+
+/**
+ * Constant indexes, local slots and upvalue indexes take one byte. Each
+ * instruction with such an operand has a _LONG form, right after it, that
+ * takes three bytes (big-endian, like jump offsets) instead; the compiler
+ * only emits it when the operand doesn't fit in a byte. OP_LOOP and
+ * OP_FOR_LOOP have _LONG forms with three-byte offsets. Forward jumps are
+ * emitted before their distance is known, so they always take three.
+ */
+#define UINT24_MAX 0xffffff
+#define UINT24_COUNT (UINT24_MAX + 1)
+
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_UPVALUE,
+    OP_GET_UPVALUE_LONG,
     OP_SET_UPVALUE,
+    OP_SET_UPVALUE_LONG,
     OP_GET_PROPERTY,
+    OP_GET_PROPERTY_LONG,
     OP_SET_PROPERTY,
+    OP_SET_PROPERTY_LONG,
     OP_GET_SUPER,
+    OP_GET_SUPER_LONG,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -27,34 +60,105 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    // Register forms, emitted when REGISTER_OPERANDS is defined. L operands
+    // are local slots and K operands constant indexes. The two-operand forms
+    // push their result; the three-operand ones store it in the first slot.
+    // Every K form directly follows its L form.
+    OP_ADD_LL,
+    OP_ADD_LK,
+    OP_SUBTRACT_LL,
+    OP_SUBTRACT_LK,
+    OP_MULTIPLY_LL,
+    OP_MULTIPLY_LK,
+    OP_DIVIDE_LL,
+    OP_DIVIDE_LK,
+    OP_LESS_LL,
+    OP_LESS_LK,
+    OP_GREATER_LL,
+    OP_GREATER_LK,
+    OP_ADD_LLL,
+    OP_ADD_LLK,
+    OP_SUBTRACT_LLL,
+    OP_SUBTRACT_LLK,
+    OP_MULTIPLY_LLL,
+    OP_MULTIPLY_LLK,
+    OP_DIVIDE_LLL,
+    OP_DIVIDE_LLK,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_LOOP_LONG,
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
+    OP_FOR_LOOP_LONG,
     OP_CALL,
-    OP_INVOKE
+    OP_TAIL_CALL,
+    OP_INVOKE,
+    OP_INVOKE_LONG,
     OP_SUPER_INVOKE,
+    OP_SUPER_INVOKE_LONG,
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
+    OP_YIELD,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    OP_EXIT,
     OP_CLASS,
+    OP_CLASS_LONG,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_METHOD_LONG,
+    OP_BUILD_LIST,
+    OP_RANGE
 } OpCode;
 
+// One past the last opcode. Keep it in step with the enum.
+#define OPCODE_COUNT (OP_RANGE + 1)
+
+typedef struct SharedCode SharedCode;
+
+/**
+ * Source lines are stored as runs: each LineStart gives the line of every
+ * byte from `offset` up to the next run's offset. Most lines compile to
+ * several instructions, so this takes a fraction of the space of one line
+ * number per byte. getLine() finds a byte's run by binary search.
+ */
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    // Set when code and lines are borrowed from a SharedCode image, which
+    // other VMs may be running at the same time. Such chunks are never
+    // written to, which also means they are never quickened.
+    SharedCode* shared;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+int readLong(Chunk* chunk, int offset);
+int getLine(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -5,12 +5,42 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * The makefile builds one binary per profile:
+ *
+ * - release (main): optimized, with every debugging hook compiled out.
+ * - debug (main-debug): built with -DDEBUG, which compiles in the hooks
+ *   below. Each stays off until it is turned on from the command line, see
+ *   DebugOptions in debug.h.
+ * - instrumented (main-instrumented): optimized, built with
+ *   -DINSTRUMENT_OPCODES to count every opcode the VM dispatches.
+ *
+ * Add -DDEBUG_STRESS_GC to any profile to collect on every allocation.
+ */
+#ifdef DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
-
-#define DEBUG_STREE_GC
 #define DEBUG_LOG_GC
+#endif
+
+// Fuses local and constant operands into three-address instructions that
+// work on frame->slots directly. Comment out to get the plain stack machine.
+#define REGISTER_OPERANDS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// The scanner and string search work on 16 bytes at a time with SSE2, which
+// every x86-64 CPU has. Other targets use the plain loops.
+#if defined(__GNUC__) && \
+    (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define X86_SIMD
+#endif
+
+/**
+ * Every piece of interpreter state - the VM, the scanner and the compiler -
+ * is thread-local. Each thread that calls initVM() gets its own isolated
+ * interpreter, so an embedder can run one per worker thread without locks.
+ */
+#define THREAD_LOCAL _Thread_local
+
 #endif
\ No newline at end of file
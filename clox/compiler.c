@@ -16,6 +16,8 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  // Where the code for the left operand of the infix rule being compiled starts.
+  int leftOperandStart;
 } Parser;
 
 typedef enum {
@@ -25,10 +27,11 @@ typedef enum {
   PREC_AND,         // and
   PREC_EQUALITY,    // == !=
   PREC_COMPARISON,  // < > <= >=
+  PREC_RANGE,       // ..
   PREC_TERM,        // + -
   PREC_FACTOR,      // * /
   PREC_UNARY,       // ! -
-  PREC_CALL,        // . ()
+  PREC_CALL,        // . () []
   PREC_PRIMARY
 } Precedence;
 
@@ -47,7 +50,7 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal;
 } Upvalue;
 
@@ -58,21 +61,46 @@ typedef struct {
  */
 typedef enum {
   TYPE_FUNCTION,
-  TYPE_INITIALIZER
+  TYPE_INITIALIZER,
   TYPE_METHOD,
   TYPE_SCRIPT,
 } FunctionType;
 
+/**
+ * Maps numbers and strings already in the chunk's constant table to their
+ * indexes, so that every use of the same name or literal shares one slot.
+ * Open addressing with linear probing; nothing is ever removed. Numbers
+ * are compared bit for bit, so 0 and -0 stay apart. Strings are interned,
+ * so comparing pointers is enough.
+ */
+typedef struct {
+  Value key;
+  int index; // -1 marks an empty slot.
+} ConstantSlot;
+
+typedef struct {
+  int count;
+  int capacity;
+  ConstantSlot* slots;
+} ConstantIndex;
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
 
-    // clox allows up to 256 local variable declarations.
-  Local locals[UINT8_COUNT];
+  // Both arrays grow as needed. Past 256 entries, instructions that refer to
+  // them switch to their _LONG forms.
+  Local* locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue* upvalues;
+  int upvalueCapacity;
+  ConstantIndex constants;
   int scopeDepth;
+  // Offset just past the OP_CALL the current statement ended with so far,
+  // in this function's chunk, or -1.
+  int lastCallEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -80,9 +108,9 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+static THREAD_LOCAL Parser parser;
+static THREAD_LOCAL Compiler* current = NULL;
+static THREAD_LOCAL ClassCompiler* currentClass = NULL;
 
 static Chunk* currentChunk() {
   return &current->function->chunk;
@@ -162,28 +190,73 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+static void emitLong(int operand) {
+  emitByte((operand >> 16) & 0xff);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
+/**
+ * Emits an instruction with a constant index, slot or upvalue operand, or
+ * its _LONG form when the operand doesn't fit in a byte.
+ */
+static void emitWithOperand(uint8_t instruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)operand);
+  } else {
+    emitByte(instruction + 1);
+    emitLong(operand);
+  }
+}
+
+// Offsets count from the end of the jump instruction.
 static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+  int offset = currentChunk()->count + 3 - loopStart;
+  if (offset <= UINT16_MAX) {
+    emitByte(OP_LOOP);
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    return;
+  }
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  offset++;
+  if (offset > UINT24_MAX) error("Loop body too large.");
+  emitByte(OP_LOOP_LONG);
+  emitLong(offset);
+}
+
+/**
+ * OP_FOR_LOOP sits at the bottom of a for-in loop. It advances the iterator
+ * held in the hidden locals starting at `slot` and, if there is another
+ * element, jumps back to the top of the body. That way each element costs
+ * a single dispatch instead of a condition plus a separate OP_LOOP.
+ */
+static void emitForLoop(int slot, int bodyStart) {
+  int offset = currentChunk()->count + 4 - bodyStart;
+  if (slot <= UINT8_MAX && offset <= UINT16_MAX) {
+    emitBytes(OP_FOR_LOOP, (uint8_t)slot);
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    return;
+  }
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  offset += 3;
+  if (offset > UINT24_MAX) error("Loop body too large.");
+  emitByte(OP_FOR_LOOP_LONG);
+  emitLong(slot);
+  emitLong(offset);
 }
 
 /**
  * Emits a bytecode instruction and writes a placeholder operand for the
- * jump offset. Two bytes are used for the jump offset operand. A 16-bit
- * offset lets us jump over up to 65,535 bytes of code, which should be
- * plenty for what is needed.
- * Returns the offset of the emitted instruction in the chunk.
+ * jump offset. The distance isn't known yet, so the operand always takes
+ * three bytes, enough to jump over 16 MB of code.
+ * Returns the offset of the placeholder in the chunk.
  */
 static int emitJump(uint8_t instruction) {
   emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+  emitLong(UINT24_MAX);
+  return currentChunk()->count - 3;
 }
 
 static void emitReturn() {
@@ -193,66 +266,246 @@ static void emitReturn() {
     emitByte(OP_NIL);
   }
 
-  emitByte(OP_NIL);
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  // Mix the exponent into the low bits, which pick the slot.
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+  if (IS_STRING(a) || IS_STRING(b)) {
+    return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+static ConstantSlot* findConstantSlot(ConstantSlot* slots, int capacity,
+                                      Value key) {
+  uint32_t index = hashConstant(key) & (capacity - 1);
+  for (;;) {
+    ConstantSlot* slot = &slots[index];
+    if (slot->index == -1 || sameConstant(slot->key, key)) return slot;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growConstantIndex(ConstantIndex* constants) {
+  int capacity = GROW_CAPACITY(constants->capacity);
+  ConstantSlot* slots = ALLOCATE(ConstantSlot, capacity);
+  for (int i = 0; i < capacity; i++) slots[i].index = -1;
+
+  for (int i = 0; i < constants->capacity; i++) {
+    ConstantSlot* old = &constants->slots[i];
+    if (old->index == -1) continue;
+    *findConstantSlot(slots, capacity, old->key) = *old;
+  }
+
+  FREE_ARRAY(ConstantSlot, constants->slots, constants->capacity);
+  constants->slots = slots;
+  constants->capacity = capacity;
+}
+
+/**
+ * Adds `value` to the chunk's constant table, or returns the index it
+ * already has there. Only numbers and strings are shared; functions are
+ * always distinct.
+ */
+static int makeConstant(Value value) {
+  ConstantIndex* constants = &current->constants;
+  bool shareable = IS_NUMBER(value) || IS_STRING(value);
+  if (shareable && constants->count > 0) {
+    ConstantSlot* slot = findConstantSlot(constants->slots,
+                                          constants->capacity, value);
+    if (slot->index != -1) return slot->index;
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > UINT24_MAX) {
       error("Too many constants in one chunk.");
       return 0;
   }
 
-  return (uint8_t)constant;
+  if (shareable) {
+    // Only grow once the value is in the constant table, where the GC can
+    // see it.
+    if (constants->count + 1 > constants->capacity * CONSTANT_INDEX_MAX_LOAD) {
+      growConstantIndex(constants);
+    }
+    ConstantSlot* slot = findConstantSlot(constants->slots,
+                                          constants->capacity, value);
+    slot->key = value;
+    slot->index = constant;
+    constants->count++;
+  }
+  return constant;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitWithOperand(OP_CONSTANT, makeConstant(value));
 }
 
 static void patchJump(int offset) {
-  // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  // -3 to adjust for the bytecode for the jump offset itself.
+  int jump = currentChunk()->count - offset - 3;
 
-  if (jump > UINT16_MAX) {
+  if (jump > UINT24_MAX) {
       error("Too much code to jump over.");
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk()->code[offset] = (jump >> 16) & 0xff;
+  currentChunk()->code[offset + 1] = (jump >> 8) & 0xff;
+  currentChunk()->code[offset + 2] = jump & 0xff;
+}
+
+// -1 depth indicates that the local variable is uninitialized
+static void addLocal(Token name) {
+    if (current->localCount == UINT24_COUNT) {
+        error("Too many local variables in function.");
+        return;
+    }
+
+    if (current->localCount == current->localCapacity) {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals,
+                                     oldCapacity, current->localCapacity);
+    }
+
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+    local->isCaptured = false;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
+  compiler->constants.count = 0;
+  compiler->constants.capacity = 0;
+  compiler->constants.slots = NULL;
   compiler->scopeDepth = 0;
+  compiler->lastCallEnd = -1;
   compiler->function = newFunction();
   current = compiler;
   if (type != TYPE_SCRIPT) {
     current->function->name = copyString(parser.previous.start, parser.previous.length);
   }
 
-  Local* local = &current->locals[current->localCount++];
-  local->depth = 0;
-  local->isCaptured = false;
+  Token name;
   if (type != TYPE_FUNCTION) {
-    local->name.start = "this";
-    local->name.length = 4;
+    name.start = "this";
+    name.length = 4;
   } else {
-    local->name.start = "";
-    local->name.length = 0;
+    name.start = "";
+    name.length = 0;
+  }
+  addLocal(name);
+  current->locals[0].depth = 0;
+}
+
+/**
+ * Returns the offset the instruction at `offset` can jump to, or -1 if it
+ * isn't a jump.
+ */
+static int jumpTarget(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      return offset + 4 + readLong(chunk, offset + 1);
+    case OP_LOOP:
+      return offset + 3 -
+             ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    case OP_LOOP_LONG:
+      return offset + 4 - readLong(chunk, offset + 1);
+    case OP_FOR_LOOP:
+      return offset + 4 -
+             ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    case OP_FOR_LOOP_LONG:
+      return offset + 7 - readLong(chunk, offset + 4);
+    default:
+      return -1;
+  }
+}
+
+static void reachInstruction(int* depths, int* pending, int* pendingCount,
+                             int count, int offset, int depth) {
+  if (offset < 0 || offset >= count || depths[offset] != -1) return;
+  depths[offset] = depth;
+  pending[(*pendingCount)++] = offset;
+}
+
+/**
+ * Returns how many stack slots a call to the function uses at most: the
+ * callee, its parameters and locals, and the temporaries of expressions.
+ * Follows every path through the chunk. The compiler keeps the depth the
+ * same on every path into an instruction, so each is looked at once.
+ */
+static int maxStackDepth(Chunk* chunk, int arity) {
+  int* depths = ALLOCATE(int, chunk->count);
+  int* pending = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+  int pendingCount = 0;
+  int max = arity + 1;
+  reachInstruction(depths, pending, &pendingCount, chunk->count, 0, max);
+
+  while (pendingCount > 0) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset] + stackEffect(chunk, offset);
+    if (depth > max) max = depth;
+
+    reachInstruction(depths, pending, &pendingCount, chunk->count,
+                     jumpTarget(chunk, offset), depth);
+    switch (chunk->code[offset]) {
+      case OP_JUMP:
+      case OP_LOOP:
+      case OP_LOOP_LONG:
+      case OP_RETURN:
+      case OP_EXIT:
+        break;
+      default:
+        reachInstruction(depths, pending, &pendingCount, chunk->count,
+                         offset + instructionLength(chunk, offset), depth);
+    }
   }
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(int, pending, chunk->count);
+  return max;
 }
 
 static ObjFunction* endCompiler() {
   emitReturn();
   ObjFunction* function = current->function;
+  if (!parser.hadError) {
+    function->slotCount = maxStackDepth(&function->chunk, function->arity);
+  }
+  // function() still needs the upvalues to emit OP_CLOSURE.
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  FREE_ARRAY(ConstantSlot, current->constants.slots,
+             current->constants.capacity);
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (debugOptions.printCode && !parser.hadError) {
       disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
   }
 #endif
@@ -296,7 +549,7 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -319,7 +572,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -329,11 +582,17 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
+    if (upvalueCount == UINT24_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
+    if (upvalueCount == compiler->upvalueCapacity) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity, compiler->upvalueCapacity);
+    }
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -345,25 +604,17 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
-// -1 depth indicates that the local variable is uninitialized
-static void addLocal(Token name) {
-    Local* local = &current->locals[current->localCount++];
-    local->name = name;
-    local->depth = -1;
-    local->isCaptured = false;
-}
-
 static void declareVariable() {
     // Early return if variable is global.
     if (current->scopeDepth == 0) return;
@@ -392,9 +643,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-
+static int declareParsedVariable() {
     declareVariable();
     // Early return if variable is local.
     if (current->scopeDepth > 0) return 0;
@@ -402,19 +651,24 @@ static uint8_t parseVariable(const char* errorMessage) {
     return identifierConstant(&parser.previous);
 }
 
+static int parseVariable(const char* errorMessage) {
+    consume(TOKEN_IDENTIFIER, errorMessage);
+    return declareParsedVariable();
+}
+
 static void markInitialized() {
     if (current->scopeDepth == 0) return;
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     // Early return if variable is local. This also means that local variables are not created at runtime.
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitWithOperand(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -441,6 +695,68 @@ static void and_(bool canAssign) {
     patchJump(endJump);
 }
 
+#ifdef REGISTER_OPERANDS
+/**
+ * If both operands of a binary operator compiled to a single load - a local
+ * on the left and a local or constant on the right - the loads are dropped
+ * and replaced with one register instruction that reads them in place.
+ * Comparisons that need an OP_NOT afterwards keep it.
+ */
+static bool fuseOperands(TokenType operatorType, int leftStart, int rightStart) {
+    Chunk* chunk = currentChunk();
+    if (rightStart - leftStart != 2 || chunk->count - rightStart != 2) return false;
+    if (chunk->code[leftStart] != OP_GET_LOCAL) return false;
+
+    uint8_t right = chunk->code[rightStart];
+    if (right != OP_GET_LOCAL && right != OP_CONSTANT) return false;
+
+    OpCode instruction;
+    bool negate = false;
+    switch (operatorType) {
+        case TOKEN_PLUS:          instruction = OP_ADD_LL; break;
+        case TOKEN_MINUS:         instruction = OP_SUBTRACT_LL; break;
+        case TOKEN_STAR:          instruction = OP_MULTIPLY_LL; break;
+        case TOKEN_SLASH:         instruction = OP_DIVIDE_LL; break;
+        case TOKEN_LESS:          instruction = OP_LESS_LL; break;
+        case TOKEN_GREATER:       instruction = OP_GREATER_LL; break;
+        case TOKEN_LESS_EQUAL:    instruction = OP_GREATER_LL; negate = true; break;
+        case TOKEN_GREATER_EQUAL: instruction = OP_LESS_LL; negate = true; break;
+        default: return false;
+    }
+    if (right == OP_CONSTANT) instruction++;
+
+    uint8_t a = chunk->code[leftStart + 1];
+    uint8_t b = chunk->code[rightStart + 1];
+    chunk->count = leftStart;
+    emitBytes(instruction, a);
+    emitByte(b);
+    if (negate) emitByte(OP_NOT);
+    return true;
+}
+
+/**
+ * `x = a + b;` used as a statement compiles to a fused operand instruction
+ * followed by OP_SET_LOCAL and the OP_POP that discards its value. All three
+ * collapse into a single three-address instruction.
+ */
+static bool fuseStore(int start) {
+    Chunk* chunk = currentChunk();
+    if (chunk->count - start != 5) return false;
+
+    uint8_t instruction = chunk->code[start];
+    if (instruction < OP_ADD_LL || instruction > OP_DIVIDE_LK) return false;
+    if (chunk->code[start + 3] != OP_SET_LOCAL) return false;
+
+    uint8_t a = chunk->code[start + 1];
+    uint8_t b = chunk->code[start + 2];
+    uint8_t dest = chunk->code[start + 4];
+    chunk->count = start;
+    emitBytes(instruction - OP_ADD_LL + OP_ADD_LLL, dest);
+    emitBytes(a, b);
+    return true;
+}
+#endif
+
 /**
  * binary() is defined before the rules table so that the table can store a pointer to it.
  * This means that the body of binary() cannot access the table directly. Instead it accesses the
@@ -449,19 +765,29 @@ static void and_(bool canAssign) {
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int leftStart = parser.leftOperandStart;
+    int rightStart = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+#ifdef REGISTER_OPERANDS
+    if (fuseOperands(operatorType, leftStart, rightStart)) return;
+#else
+    (void)leftStart;
+    (void)rightStart;
+#endif
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        // The 0 after each arithmetic opcode is its type feedback counter.
+        case TOKEN_GREATER:       emitBytes(OP_GREATER, 0); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, 0); emitByte(OP_NOT); break;
+        case TOKEN_LESS:          emitBytes(OP_LESS, 0); break;
+        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, 0); emitByte(OP_NOT); break;
+        case TOKEN_PLUS:          emitBytes(OP_ADD, 0); break;
+        case TOKEN_MINUS:         emitBytes(OP_SUBTRACT, 0); break;
+        case TOKEN_STAR:          emitBytes(OP_MULTIPLY, 0); break;
+        case TOKEN_SLASH:         emitBytes(OP_DIVIDE, 0); break;
         default:
             return; //Unreachable.
     }
@@ -471,21 +797,55 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    current->lastCallEnd = currentChunk()->count;
+}
+
+static void list(bool canAssign) {
+    int itemCount = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (check(TOKEN_RIGHT_BRACKET)) break; // Trailing comma.
+            expression();
+            if (itemCount == 255) {
+                error("Can't have more than 255 items in a list literal.");
+            }
+            itemCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(OP_BUILD_LIST, (uint8_t)itemCount);
+}
+
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
+static void range(bool canAssign) {
+    parsePrecedence((Precedence)(PREC_RANGE + 1));
+    emitByte(OP_RANGE);
 }
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitWithOperand(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitWithOperand(OP_INVOKE, name);
     emitByte(argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitWithOperand(OP_GET_PROPERTY, name);
   }
 }
 
@@ -542,9 +902,9 @@ static void namedVariable(Token name, bool canAssign) {
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitWithOperand(setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitWithOperand(getOp, arg);
     }
 }
 
@@ -577,17 +937,17 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitWithOperand(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitWithOperand(OP_GET_SUPER, name);
   }
 }
 
@@ -595,7 +955,7 @@ static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(PREC_UNARY);
 
     // Emit the operator instruction.
     switch (operatorType) {
@@ -605,11 +965,28 @@ static void unary(bool canAssign) {
     }
 }
 
+/**
+ * `yield value` suspends the running fiber and hands `value` to whoever
+ * resumed it. The expression evaluates to the value the fiber is resumed
+ * with. A bare `yield` hands over nil.
+ */
+static void yield_(bool canAssign) {
+    if (check(TOKEN_SEMICOLON) || check(TOKEN_RIGHT_PAREN) ||
+        check(TOKEN_RIGHT_BRACKET) || check(TOKEN_COMMA)) {
+        emitByte(OP_NIL);
+    } else {
+        parsePrecedence(PREC_ASSIGNMENT);
+    }
+    emitByte(OP_YIELD);
+}
+
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -625,6 +1002,7 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+  [TOKEN_DOT_DOT]       = {NULL,     range,  PREC_RANGE},
   [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
@@ -635,6 +1013,7 @@ ParseRule rules[] = {
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IN]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
   [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
@@ -644,6 +1023,7 @@ ParseRule rules[] = {
   [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_YIELD]         = {yield_,   NULL,   PREC_NONE},
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -657,11 +1037,13 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int operandStart = currentChunk()->count;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        parser.leftOperandStart = operandStart;
         infixRule(canAssign);
     }
 
@@ -702,7 +1084,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -712,17 +1094,33 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    int constant = makeConstant(OBJ_VAL(function));
+    // The long form widens the upvalue indexes too.
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
 
+    if (wide) {
+        emitByte(OP_CLOSURE_LONG);
+        emitLong(constant);
+    } else {
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
+    }
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (wide) {
+            emitLong(compiler.upvalues[i].index);
+        } else {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
     }
+    FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
@@ -731,16 +1129,16 @@ static void method() {
   }
 
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitWithOperand(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
+  emitWithOperand(OP_CLASS, nameConstant);
   defineVariable(nameConstant);
 
   ClassCompiler classCompiler;
@@ -756,15 +1154,15 @@ static void classDeclaration() {
       error("A class can't inherit from itself.");
     }
 
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
     namedVariable(className, false);
     emitByte(OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
-  beginScope();
-  addLocal(syntheticToken("super"));
-  defineVariable(0);
-
   namedVariable(className, false);
   consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
@@ -781,15 +1179,18 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
-
+/**
+ * Compiles the rest of a variable declaration once its name has been parsed
+ * and declared. Split out of varDeclaration() so that forStatement() can look
+ * past the name for an `in` before committing to a C-style initializer.
+ */
+static void varInitializer(int global) {
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -800,19 +1201,81 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
-static void expressionStatement() {
+static void varDeclaration() {
+    int global = parseVariable("Expect variable name.");
+    varInitializer(global);
+}
+
+/**
+ * Compiles an expression whose value is thrown away, as in expression
+ * statements and for loop increments.
+ */
+static void expressionForEffect() {
+    int start = currentChunk()->count;
     expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+
+#ifdef REGISTER_OPERANDS
+    if (fuseStore(start)) return;
+#else
+    (void)start;
+#endif
     emitByte(OP_POP);
 }
 
+static void expressionStatement() {
+    expressionForEffect();
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+/**
+ * Compiles `for (var x in sequence) body`. The loop keeps its state in three
+ * locals: the sequence, the current index and the loop variable itself. For
+ * a range the element is the range's start plus the index, so it can't get
+ * stuck where adding one to a large number rounds back to the same number. The first two have names that can't be
+ * written in Lox, so user code can never see them.
+ *
+ * The body is entered by jumping straight to OP_FOR_LOOP at the bottom, which
+ * both advances the iterator and jumps back, so there is exactly one dispatch
+ * per element on top of the body.
+ */
+static void forInStatement(Token name) {
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    int sequenceSlot = current->localCount;
+    addLocal(syntheticToken("(sequence)"));
+    markInitialized();
+    addLocal(syntheticToken("(index)"));
+    markInitialized();
+    addLocal(name);
+    markInitialized();
+
+    // Checks the sequence and pushes the index and loop variable.
+    emitByte(OP_FOR_PREP);
+    int firstJump = emitJump(OP_JUMP);
+
+    int bodyStart = currentChunk()->count;
+    statement();
+
+    patchJump(firstJump);
+    emitForLoop(sequenceSlot, bodyStart);
+
+    endScope();
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
     if (match(TOKEN_SEMICOLON)) {
         // No initializer.
     } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+        consume(TOKEN_IDENTIFIER, "Expect variable name.");
+        Token name = parser.previous;
+        if (match(TOKEN_IN)) {
+            forInStatement(name);
+            return;
+        }
+        varInitializer(declareParsedVariable());
     } else {
         expressionStatement();
     }
@@ -831,8 +1294,7 @@ static void forStatement() {
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
         int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
+        expressionForEffect();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emitLoop(loopStart);
@@ -890,6 +1352,16 @@ static void returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    /**
+     * When the returned expression ends in a call, its result is the return
+     * value, so the call can reuse this function's frame. The OP_RETURN is
+     * still needed: OP_TAIL_CALL falls back to a regular call for natives
+     * and classes, and `and`/`or` can jump past the call straight to it.
+     */
+    if (current->lastCallEnd == currentChunk()->count) {
+      currentChunk()->code[currentChunk()->count - 2] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -944,6 +1416,7 @@ static void declaration() {
   } else {
     statement();
   }
+  current->lastCallEnd = -1;
 
   if (parser.panicMode) synchronize();
 }
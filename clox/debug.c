@@ -4,6 +4,111 @@
 #include "object.h"
 #include "value.h"
 
+#ifdef DEBUG
+DebugOptions debugOptions;
+#endif
+
+static const char* const opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+    [OP_GET_INDEX] = "OP_GET_INDEX",
+    [OP_SET_INDEX] = "OP_SET_INDEX",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_ADD_LL] = "OP_ADD_LL",
+    [OP_ADD_LK] = "OP_ADD_LK",
+    [OP_SUBTRACT_LL] = "OP_SUBTRACT_LL",
+    [OP_SUBTRACT_LK] = "OP_SUBTRACT_LK",
+    [OP_MULTIPLY_LL] = "OP_MULTIPLY_LL",
+    [OP_MULTIPLY_LK] = "OP_MULTIPLY_LK",
+    [OP_DIVIDE_LL] = "OP_DIVIDE_LL",
+    [OP_DIVIDE_LK] = "OP_DIVIDE_LK",
+    [OP_LESS_LL] = "OP_LESS_LL",
+    [OP_LESS_LK] = "OP_LESS_LK",
+    [OP_GREATER_LL] = "OP_GREATER_LL",
+    [OP_GREATER_LK] = "OP_GREATER_LK",
+    [OP_ADD_LLL] = "OP_ADD_LLL",
+    [OP_ADD_LLK] = "OP_ADD_LLK",
+    [OP_SUBTRACT_LLL] = "OP_SUBTRACT_LLL",
+    [OP_SUBTRACT_LLK] = "OP_SUBTRACT_LLK",
+    [OP_MULTIPLY_LLL] = "OP_MULTIPLY_LLL",
+    [OP_MULTIPLY_LLK] = "OP_MULTIPLY_LLK",
+    [OP_DIVIDE_LLL] = "OP_DIVIDE_LLL",
+    [OP_DIVIDE_LLK] = "OP_DIVIDE_LLK",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_FOR_PREP] = "OP_FOR_PREP",
+    [OP_FOR_LOOP] = "OP_FOR_LOOP",
+    [OP_FOR_LOOP_LONG] = "OP_FOR_LOOP_LONG",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_YIELD] = "OP_YIELD",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_EXIT] = "OP_EXIT",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_BUILD_LIST] = "OP_BUILD_LIST",
+    [OP_RANGE] = "OP_RANGE",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= OPCODE_COUNT || opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
@@ -20,6 +125,15 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    int constant = readLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk,
                                 int offset) {
   uint8_t constant = chunk->code[offset + 1];
@@ -30,6 +144,16 @@ static int invokeInstruction(const char* name, Chunk* chunk,
   return offset + 3;
 }
 
+static int invokeLongInstruction(const char* name, Chunk* chunk,
+                                 int offset) {
+  int constant = readLong(chunk, offset + 1);
+  uint8_t argCount = chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -48,6 +172,50 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int longInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d\n", name, readLong(chunk, offset + 1));
+    return offset + 4;
+}
+
+/**
+ * Arithmetic instructions carry a type feedback counter. Printing it shows
+ * how close a generic instruction is to being quickened; specialized forms
+ * keep the count they had when they were rewritten.
+ */
+static int feedbackInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t counter = chunk->code[offset + 1];
+    printf("%-16s %4d/%d\n", name, counter, QUICKEN_THRESHOLD);
+    return offset + 2;
+}
+
+/**
+ * Register instructions name their operands directly. Local slots are shown
+ * as r<slot>, like registers, and constants with their value.
+ */
+static void printOperand(Chunk* chunk, uint8_t operand, bool isConstant) {
+    if (isConstant) {
+        printf("'");
+        printValue(chunk->constants.values[operand]);
+        printf("'");
+    } else {
+        printf("r%d", operand);
+    }
+}
+
+static int registerInstruction(const char* name, Chunk* chunk, int offset,
+                               bool hasDest, bool isConstant) {
+    printf("%-16s ", name);
+    if (hasDest) {
+        printf("r%d <- ", chunk->code[offset + 1]);
+        offset++;
+    }
+    printOperand(chunk, chunk->code[offset + 1], false);
+    printf(", ");
+    printOperand(chunk, chunk->code[offset + 2], isConstant);
+    printf("\n");
+    return offset + 3;
+}
+
 // TODO write a meaningful description of what this does.
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -58,18 +226,78 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk,
+                               int offset) {
+    int jump = readLong(chunk, offset + 1);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+static int forLoopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+
+    printf("%-16s %4d -> %d\n", name, slot, offset + 4 - jump);
+
+    return offset + 4;
+}
+
+static int forLoopLongInstruction(const char* name, Chunk* chunk,
+                                  int offset) {
+    int slot = readLong(chunk, offset + 1);
+    int jump = readLong(chunk, offset + 4);
+    printf("%-16s %4d -> %d\n", name, slot, offset + 7 - jump);
+    return offset + 7;
+}
+
+static int closureInstruction(const char* name, Chunk* chunk, int offset,
+                              bool isLong) {
+    offset++;
+    int constant;
+    if (isLong) {
+        constant = readLong(chunk, offset);
+        offset += 3;
+    } else {
+        constant = chunk->code[offset++];
+    }
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int entry = offset;
+        int isLocal = chunk->code[offset++];
+        int index;
+        if (isLong) {
+            index = readLong(chunk, offset);
+            offset += 3;
+        } else {
+            index = chunk->code[offset++];
+        }
+        printf("%04d      |                     %s %d\n",
+               entry, isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -80,38 +308,116 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_GET_UPVALUE_LONG:
+            return longInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_VALUE", chunk, offset);
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return longInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
         case OP_GET_PROPERTY:
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return constantLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
          case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+         case OP_SET_PROPERTY_LONG:
+            return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
-            return simpleInstruction("OP_GREATER", offset);
+            return feedbackInstruction("OP_GREATER", chunk, offset);
         case OP_LESS:
-            return simpleInstruction("OP_LESS", offset);
+            return feedbackInstruction("OP_LESS", chunk, offset);
         case OP_ADD:
-            return constantInstruction("OP_ADD", chunk, offset);
+            return feedbackInstruction("OP_ADD", chunk, offset);
         case OP_SUBTRACT:
-            return constantInstruction("OP_SUBTRACT", chunk, offset);
+            return feedbackInstruction("OP_SUBTRACT", chunk, offset);
         case OP_MULTIPLY:
-            return constantInstruction("OP_MULTIPLY", chunk, offset);
+            return feedbackInstruction("OP_MULTIPLY", chunk, offset);
         case OP_DIVIDE:
-            return constantInstruction("OP_DIVIDE", chunk, offset);
+            return feedbackInstruction("OP_DIVIDE", chunk, offset);
+        case OP_GREATER_NUM:
+            return feedbackInstruction("OP_GREATER_NUM", chunk, offset);
+        case OP_LESS_NUM:
+            return feedbackInstruction("OP_LESS_NUM", chunk, offset);
+        case OP_ADD_NUM:
+            return feedbackInstruction("OP_ADD_NUM", chunk, offset);
+        case OP_ADD_STR:
+            return feedbackInstruction("OP_ADD_STR", chunk, offset);
+        case OP_SUBTRACT_NUM:
+            return feedbackInstruction("OP_SUBTRACT_NUM", chunk, offset);
+        case OP_MULTIPLY_NUM:
+            return feedbackInstruction("OP_MULTIPLY_NUM", chunk, offset);
+        case OP_DIVIDE_NUM:
+            return feedbackInstruction("OP_DIVIDE_NUM", chunk, offset);
+        case OP_ADD_LL:
+            return registerInstruction("OP_ADD_LL", chunk, offset, false, false);
+        case OP_ADD_LK:
+            return registerInstruction("OP_ADD_LK", chunk, offset, false, true);
+        case OP_SUBTRACT_LL:
+            return registerInstruction("OP_SUBTRACT_LL", chunk, offset, false, false);
+        case OP_SUBTRACT_LK:
+            return registerInstruction("OP_SUBTRACT_LK", chunk, offset, false, true);
+        case OP_MULTIPLY_LL:
+            return registerInstruction("OP_MULTIPLY_LL", chunk, offset, false, false);
+        case OP_MULTIPLY_LK:
+            return registerInstruction("OP_MULTIPLY_LK", chunk, offset, false, true);
+        case OP_DIVIDE_LL:
+            return registerInstruction("OP_DIVIDE_LL", chunk, offset, false, false);
+        case OP_DIVIDE_LK:
+            return registerInstruction("OP_DIVIDE_LK", chunk, offset, false, true);
+        case OP_LESS_LL:
+            return registerInstruction("OP_LESS_LL", chunk, offset, false, false);
+        case OP_LESS_LK:
+            return registerInstruction("OP_LESS_LK", chunk, offset, false, true);
+        case OP_GREATER_LL:
+            return registerInstruction("OP_GREATER_LL", chunk, offset, false, false);
+        case OP_GREATER_LK:
+            return registerInstruction("OP_GREATER_LK", chunk, offset, false, true);
+        case OP_ADD_LLL:
+            return registerInstruction("OP_ADD_LLL", chunk, offset, true, false);
+        case OP_ADD_LLK:
+            return registerInstruction("OP_ADD_LLK", chunk, offset, true, true);
+        case OP_SUBTRACT_LLL:
+            return registerInstruction("OP_SUBTRACT_LLL", chunk, offset, true, false);
+        case OP_SUBTRACT_LLK:
+            return registerInstruction("OP_SUBTRACT_LLK", chunk, offset, true, true);
+        case OP_MULTIPLY_LLL:
+            return registerInstruction("OP_MULTIPLY_LLL", chunk, offset, true, false);
+        case OP_MULTIPLY_LLK:
+            return registerInstruction("OP_MULTIPLY_LLK", chunk, offset, true, true);
+        case OP_DIVIDE_LLL:
+            return registerInstruction("OP_DIVIDE_LLL", chunk, offset, true, false);
+        case OP_DIVIDE_LLK:
+            return registerInstruction("OP_DIVIDE_LLK", chunk, offset, true, true);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
@@ -119,45 +425,57 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+            return jumpLongInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jumpLongInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_FOR_PREP:
+            return simpleInstruction("OP_FOR_PREP", offset);
+        case OP_FOR_LOOP:
+            return forLoopInstruction("OP_FOR_LOOP", chunk, offset);
+        case OP_FOR_LOOP_LONG:
+            return forLoopLongInstruction("OP_FOR_LOOP_LONG", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function = AS_FUNCTION(
-                chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",
-                       offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
-        }
+        case OP_SUPER_INVOKE_LONG:
+            return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset, false);
+        case OP_CLOSURE_LONG:
+            return closureInstruction("OP_CLOSURE_LONG", chunk, offset, true);
+        case OP_YIELD:
+            return simpleInstruction("OP_YIELD", offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_EXIT:
+            return simpleInstruction("OP_EXIT", offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_RANGE:
+            return simpleInstruction("OP_RANGE", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -3,6 +3,21 @@
 
 #include "chunk.h"
 
+#ifdef DEBUG
+/**
+ * What a debug build prints, chosen with command-line flags. Everything
+ * starts off, so a debug binary runs quietly until asked.
+ */
+typedef struct {
+    bool printCode;      // --print-code: disassemble each compiled function.
+    bool traceExecution; // --trace: print the stack before each instruction.
+    bool logGC;          // --log-gc: report allocations and collections.
+} DebugOptions;
+
+extern DebugOptions debugOptions;
+#endif
+
+const char* opcodeName(uint8_t instruction);
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
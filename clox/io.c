@@ -0,0 +1,690 @@
+#define _GNU_SOURCE // For accept4().
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "memory.h"
+#include "native.h"
+#include "vm.h"
+#include "worker.h"
+
+#define IO_EVENTS_MAX 64
+#define IO_READ_MAX 4096
+// About 31 years. Longer sleeps are cut to this.
+#define SLEEP_MS_MAX 1e12
+
+void initLoop(Loop* loop) {
+    loop->epollFd = -1;
+    loop->waits = NULL;
+    loop->waitCapacity = 0;
+    loop->waitCount = 0;
+    loop->readyHead = NULL;
+    loop->readyTail = NULL;
+    loop->blocked = false;
+    loop->blockFd = -1;
+}
+
+void freeLoop(Loop* loop) {
+    if (loop->epollFd != -1) close(loop->epollFd);
+    for (int fd = 0; fd < loop->waitCapacity; fd++) {
+        IoWait* wait = loop->waits[fd].head;
+        while (wait != NULL) {
+            IoWait* next = wait->next;
+            free(wait);
+            wait = next;
+        }
+    }
+    free(loop->waits);
+    initLoop(loop);
+}
+
+void markLoop(Loop* loop) {
+    for (int fd = 0; fd < loop->waitCapacity; fd++) {
+        for (IoWait* wait = loop->waits[fd].head;
+             wait != NULL;
+             wait = wait->next) {
+            markObject((Obj*)wait->fiber);
+            for (int i = 0; i < wait->argCount; i++) markValue(wait->args[i]);
+        }
+    }
+    for (ObjFiber* fiber = loop->readyHead;
+         fiber != NULL;
+         fiber = fiber->nextReady) {
+        markObject((Obj*)fiber);
+    }
+    if (loop->blocked) {
+        for (int i = 0; i < loop->block.argCount; i++) {
+            markValue(loop->block.args[i]);
+        }
+    }
+}
+
+/**
+ * Called by a native whose operation on `fd` would block. The native is
+ * expected to return what this returns. `retry` is called with a copy of
+ * `args` once `fd` reports `events`, and may itself call ioBlock() again.
+ * The arguments were checked by the first call, so a retry must not raise
+ * an error.
+ */
+Value ioBlock(int fd, uint32_t events, NativeFn retry,
+              int argCount, Value* args) {
+    Loop* loop = &vm.loop;
+    loop->blocked = true;
+    loop->blockFd = fd;
+    loop->block.fiber = NULL;
+    loop->block.events = events;
+    loop->block.retry = retry;
+    loop->block.argCount = argCount;
+    memcpy(loop->block.args, args, sizeof(Value) * argCount);
+    return NIL_VAL;
+}
+
+// Points epoll at the union of the events the waiters on `fd` want.
+static bool watch(int fd) {
+    Loop* loop = &vm.loop;
+    IoWaiters* waiters = &loop->waits[fd];
+    uint32_t events = 0;
+    for (IoWait* wait = waiters->head; wait != NULL; wait = wait->next) {
+        events |= wait->events;
+    }
+    if (events == waiters->events) return true;
+
+    int operation = EPOLL_CTL_MOD;
+    if (waiters->events == 0) operation = EPOLL_CTL_ADD;
+    if (events == 0) operation = EPOLL_CTL_DEL;
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    // Closing a descriptor takes it out of epoll, so a failed delete is fine.
+    if (epoll_ctl(loop->epollFd, operation, fd, &event) == -1 &&
+        operation != EPOLL_CTL_DEL) {
+        return false;
+    }
+    waiters->events = events;
+    return true;
+}
+
+static void unlinkWait(IoWaiters* waiters, IoWait* wait) {
+    IoWait* previous = NULL;
+    for (IoWait* current = waiters->head; current != wait;
+         current = current->next) {
+        previous = current;
+    }
+    if (previous == NULL) {
+        waiters->head = wait->next;
+    } else {
+        previous->next = wait->next;
+    }
+    if (waiters->tail == wait) waiters->tail = previous;
+}
+
+// Makes `fiber` wait for what the last ioBlock() asked for.
+bool ioPark(ObjFiber* fiber) {
+    Loop* loop = &vm.loop;
+    loop->blocked = false;
+    int fd = loop->blockFd;
+
+    if (loop->epollFd == -1) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd == -1) return false;
+    }
+
+    if (fd >= loop->waitCapacity) {
+        int capacity = loop->waitCapacity < 8 ? 8 : loop->waitCapacity;
+        while (capacity <= fd) capacity *= 2;
+        IoWaiters* waits = (IoWaiters*)realloc(loop->waits,
+                                               sizeof(IoWaiters) * capacity);
+        if (waits == NULL) exit(1);
+        memset(waits + loop->waitCapacity, 0,
+               sizeof(IoWaiters) * (capacity - loop->waitCapacity));
+        loop->waits = waits;
+        loop->waitCapacity = capacity;
+    }
+
+    IoWait* wait = (IoWait*)malloc(sizeof(IoWait));
+    if (wait == NULL) exit(1);
+    *wait = loop->block;
+    wait->fiber = fiber;
+    wait->next = NULL;
+
+    IoWaiters* waiters = &loop->waits[fd];
+    if (waiters->tail == NULL) {
+        waiters->head = wait;
+    } else {
+        waiters->tail->next = wait;
+    }
+    waiters->tail = wait;
+    if (!watch(fd)) {
+        unlinkWait(waiters, wait);
+        free(wait);
+        return false;
+    }
+    loop->waitCount++;
+    return true;
+}
+
+static void makeReady(ObjFiber* fiber) {
+    fiber->nextReady = NULL;
+    if (vm.loop.readyTail == NULL) {
+        vm.loop.readyHead = fiber;
+    } else {
+        vm.loop.readyTail->nextReady = fiber;
+    }
+    vm.loop.readyTail = fiber;
+}
+
+static void unpark(int fd, IoWait* wait) {
+    Loop* loop = &vm.loop;
+    unlinkWait(&loop->waits[fd], wait);
+    free(wait);
+    loop->waitCount--;
+    watch(fd);
+}
+
+// Hands `result` to a fiber that was parked in the middle of a native call.
+static void finishWait(ObjFiber* fiber, Value result) {
+    fiber->stackTop[-1] = result;
+    makeReady(fiber);
+}
+
+static void retry(int fd, IoWait* wait) {
+    // The wait stays queued until the retry is done, so the GC still sees
+    // the fiber and the arguments.
+    Loop* loop = &vm.loop;
+    ObjFiber* fiber = wait->fiber;
+    Value result = wait->retry(wait->argCount, wait->args);
+
+    if (loop->blocked && loop->blockFd == fd) {
+        // Not ready after all, so it keeps its place in the queue.
+        loop->blocked = false;
+        IoWait* next = wait->next;
+        *wait = loop->block;
+        wait->fiber = fiber;
+        wait->next = next;
+        watch(fd);
+        return;
+    }
+
+    unpark(fd, wait);
+    if (loop->blocked && ioPark(fiber)) return;
+    loop->blocked = false;
+    finishWait(fiber, result);
+}
+
+static void wake(int fd, uint32_t events) {
+    Loop* loop = &vm.loop;
+    if (fd >= loop->waitCapacity) return;
+
+    // Every waiter has to hear about an error or a hangup.
+    if (events & (EPOLLERR | EPOLLHUP)) events |= EPOLLIN | EPOLLOUT;
+    IoWait* wait = loop->waits[fd].head;
+    while (wait != NULL) {
+        IoWait* next = wait->next;
+        if (wait->events & events) retry(fd, wait);
+        wait = next;
+    }
+}
+
+/**
+ * Returns the next fiber that can run, waiting in epoll until one can.
+ * Returns NULL when no fiber is ready or waiting.
+ */
+ObjFiber* ioNextFiber() {
+    Loop* loop = &vm.loop;
+    while (loop->readyHead == NULL) {
+        if (loop->waitCount == 0) return NULL;
+
+        struct epoll_event events[IO_EVENTS_MAX];
+        beginPoolWait();
+        int count = epoll_wait(loop->epollFd, events, IO_EVENTS_MAX, -1);
+        endPoolWait();
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        for (int i = 0; i < count; i++) {
+            wake(events[i].data.fd, events[i].events);
+        }
+    }
+
+    ObjFiber* fiber = loop->readyHead;
+    loop->readyHead = fiber->nextReady;
+    if (loop->readyHead == NULL) loop->readyTail = NULL;
+    fiber->nextReady = NULL;
+    return fiber;
+}
+
+// Ends `fiber` and every fiber waiting on it, except the main fiber.
+static void abandon(ObjFiber* fiber) {
+    while (fiber != NULL) {
+        ObjFiber* caller = fiber->caller;
+        if (fiber != vm.mainFiber) fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber = caller;
+    }
+}
+
+// Drops every task and wait after a runtime error.
+void ioReset() {
+    Loop* loop = &vm.loop;
+    for (int fd = 0; fd < loop->waitCapacity; fd++) {
+        while (loop->waits[fd].head != NULL) {
+            abandon(loop->waits[fd].head->fiber);
+            unpark(fd, loop->waits[fd].head);
+        }
+    }
+    while (loop->readyHead != NULL) {
+        abandon(loop->readyHead);
+        loop->readyHead = loop->readyHead->nextReady;
+    }
+    loop->readyTail = NULL;
+    loop->blocked = false;
+}
+
+/**
+ * The sockets the I/O natives have handed out and not yet closed. read(),
+ * write(), accept() and close() take only these, so a script can't touch
+ * the loop's epoll descriptor, a timer, or the eventfd of a worker or a
+ * channel. Descriptors belong to the process rather than a VM, and a
+ * socket can be passed to a worker and closed there, so the table is
+ * shared by every thread.
+ */
+static pthread_mutex_t socketsLock = PTHREAD_MUTEX_INITIALIZER;
+static bool* sockets = NULL;
+static int socketCapacity = 0;
+
+static Value addSocket(int fd) {
+    pthread_mutex_lock(&socketsLock);
+    if (fd >= socketCapacity) {
+        int capacity = socketCapacity < 8 ? 8 : socketCapacity;
+        while (capacity <= fd) capacity *= 2;
+        bool* grown = (bool*)realloc(sockets, sizeof(bool) * capacity);
+        if (grown == NULL) exit(1);
+        memset(grown + socketCapacity, 0,
+               sizeof(bool) * (capacity - socketCapacity));
+        sockets = grown;
+        socketCapacity = capacity;
+    }
+    sockets[fd] = true;
+    pthread_mutex_unlock(&socketsLock);
+    return NUMBER_VAL(fd);
+}
+
+// Returns false if `fd` isn't a socket that is still open.
+static bool removeSocket(int fd) {
+    pthread_mutex_lock(&socketsLock);
+    bool open = fd < socketCapacity && sockets[fd];
+    if (open) sockets[fd] = false;
+    pthread_mutex_unlock(&socketsLock);
+    return open;
+}
+
+// Checks the range before converting, which is undefined outside it.
+static bool isDescriptor(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 &&
+           AS_NUMBER(value) <= INT_MAX &&
+           AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+static bool isSocket(Value value) {
+    if (!isDescriptor(value)) return false;
+    int fd = (int)AS_NUMBER(value);
+    pthread_mutex_lock(&socketsLock);
+    bool open = fd < socketCapacity && sockets[fd];
+    pthread_mutex_unlock(&socketsLock);
+    return open;
+}
+
+static bool wouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/**
+ * schedule(fiber, value) runs a fiber that hasn't started yet as a task,
+ * passing `value` to its function. Returns the fiber.
+ */
+Value scheduleNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2) {
+        return nativeError("Expected 1 or 2 arguments but got %d.", argCount);
+    }
+    if (!IS_FIBER(args[0])) return nativeError("schedule() takes a fiber.");
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state != FIBER_NEW) {
+        return nativeError("Can only schedule a fiber that hasn't started.");
+    }
+
+    if (fiber->frames[0].closure->function->arity == 1) {
+        *fiber->stackTop++ = argCount == 2 ? args[1] : NIL_VAL;
+    }
+    fiber->state = FIBER_RUNNING;
+    makeReady(fiber);
+    return args[0];
+}
+
+static Value timerDoneNative(int argCount, Value* args) {
+    int fd = (int)AS_NUMBER(args[0]);
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == -1 && wouldBlock()) {
+        return ioBlock(fd, EPOLLIN, timerDoneNative, argCount, args);
+    }
+    close(fd);
+    return NIL_VAL;
+}
+
+// sleep(ms) lets other fibers run for at least `ms` milliseconds.
+Value sleepNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_NUMBER(args[0]) || isnan(AS_NUMBER(args[0]))) {
+        return nativeError("sleep() takes a number of milliseconds.");
+    }
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) return NIL_VAL;
+
+    double ms = fmin(AS_NUMBER(args[0]), SLEEP_MS_MAX);
+    long long ns = ms > 0 ? (long long)(ms * 1000000) : 0;
+    // A zero timeout would disarm the timer.
+    if (ns < 1) ns = 1;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+        close(fd);
+        return NIL_VAL;
+    }
+
+    Value timer = NUMBER_VAL(fd);
+    return ioBlock(fd, EPOLLIN, timerDoneNative, 1, &timer);
+}
+
+Value readFileNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_STRING(args[0])) return nativeError("readFile() takes a path.");
+
+    FILE* file = fopen(AS_CSTRING(args[0]), "rb");
+    if (file == NULL) return NIL_VAL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size < 0) {
+        fclose(file);
+        return NIL_VAL;
+    }
+    if (size > INT_MAX - 1) {
+        fclose(file);
+        return nativeError("File is too large to read into a string.");
+    }
+
+    char* buffer = ALLOCATE(char, size + 1);
+    size_t bytesRead = fread(buffer, sizeof(char), size, file);
+    fclose(file);
+    if (bytesRead < (size_t)size) {
+        FREE_ARRAY(char, buffer, size + 1);
+        return NIL_VAL;
+    }
+    buffer[size] = '\0';
+    return OBJ_VAL(takeString(buffer, (int)size));
+}
+
+// Returns true if the whole string was written.
+Value writeFileNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("writeFile() takes a path and a string.");
+    }
+
+    FILE* file = fopen(AS_CSTRING(args[0]), "wb");
+    if (file == NULL) return BOOL_VAL(false);
+
+    ObjString* text = AS_STRING(args[1]);
+    size_t written = fwrite(text->chars, sizeof(char), text->length, file);
+    bool ok = fclose(file) == 0 && written == (size_t)text->length;
+    return BOOL_VAL(ok);
+}
+
+static bool isAddress(Value host, Value port) {
+    return IS_STRING(host) && IS_NUMBER(port);
+}
+
+static struct addrinfo* resolve(Value host, Value port) {
+    // Numeric addresses only: a name lookup would block the whole loop.
+    char service[16];
+    snprintf(service, sizeof(service), "%d", (int)AS_NUMBER(port));
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+    struct addrinfo* address;
+    if (getaddrinfo(AS_CSTRING(host), service, &hints, &address) != 0) {
+        return NULL;
+    }
+    return address;
+}
+
+static Value listenOn(int fd, struct sockaddr* address, socklen_t length) {
+    if (bind(fd, address, length) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return NIL_VAL;
+    }
+    return addSocket(fd);
+}
+
+// listen(host, port) returns a listening TCP socket.
+Value listenNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!isAddress(args[0], args[1])) {
+        return nativeError("listen() takes an address and a port.");
+    }
+    struct addrinfo* address = resolve(args[0], args[1]);
+    if (address == NULL) return NIL_VAL;
+
+    Value result = NIL_VAL;
+    int fd = socket(address->ai_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1) {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        result = listenOn(fd, address->ai_addr, address->ai_addrlen);
+    }
+    freeaddrinfo(address);
+    return result;
+}
+
+// Raises an error and returns false if `path` can't name a socket.
+static bool unixAddress(Value path, struct sockaddr_un* address) {
+    if (!IS_STRING(path)) {
+        nativeError("Socket path must be a string.");
+        return false;
+    }
+    if (AS_STRING(path)->length >= (int)sizeof(address->sun_path)) {
+        nativeError("Socket path is too long.");
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, AS_CSTRING(path), AS_STRING(path)->length);
+    return true;
+}
+
+// listenUnix(path) returns a listening Unix domain socket.
+Value listenUnixNative(int argCount, Value* args) {
+    (void)argCount;
+    struct sockaddr_un address;
+    if (!unixAddress(args[0], &address)) return NIL_VAL;
+
+    // A socket left behind by an earlier run would make bind() fail.
+    struct stat status;
+    if (stat(address.sun_path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(address.sun_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return NIL_VAL;
+    return listenOn(fd, (struct sockaddr*)&address, sizeof(address));
+}
+
+static Value acceptReadyNative(int argCount, Value* args) {
+    int fd = (int)AS_NUMBER(args[0]);
+    int connection = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connection == -1) {
+        if (wouldBlock()) {
+            return ioBlock(fd, EPOLLIN, acceptReadyNative, argCount, args);
+        }
+        return NIL_VAL;
+    }
+    return addSocket(connection);
+}
+
+// accept(socket) waits for a connection and returns its socket.
+Value acceptNative(int argCount, Value* args) {
+    if (!isSocket(args[0])) return nativeError("accept() takes a socket.");
+    return acceptReadyNative(argCount, args);
+}
+
+static Value connectDoneNative(int argCount, Value* args) {
+    (void)argCount;
+    int fd = (int)AS_NUMBER(args[0]);
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 ||
+        error != 0) {
+        close(fd);
+        return NIL_VAL;
+    }
+    return addSocket(fd);
+}
+
+static Value connectTo(int fd, struct sockaddr* address, socklen_t length) {
+    if (connect(fd, address, length) == 0) return addSocket(fd);
+    if (errno == EINPROGRESS) {
+        Value socket = NUMBER_VAL(fd);
+        return ioBlock(fd, EPOLLOUT, connectDoneNative, 1, &socket);
+    }
+    close(fd);
+    return NIL_VAL;
+}
+
+// connect(host, port) returns a connected TCP socket.
+Value connectNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!isAddress(args[0], args[1])) {
+        return nativeError("connect() takes an address and a port.");
+    }
+    struct addrinfo* address = resolve(args[0], args[1]);
+    if (address == NULL) return NIL_VAL;
+
+    Value result = NIL_VAL;
+    int fd = socket(address->ai_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1) result = connectTo(fd, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(address);
+    return result;
+}
+
+// connectUnix(path) returns a connected Unix domain socket.
+Value connectUnixNative(int argCount, Value* args) {
+    (void)argCount;
+    struct sockaddr_un address;
+    if (!unixAddress(args[0], &address)) return NIL_VAL;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return NIL_VAL;
+    return connectTo(fd, (struct sockaddr*)&address, sizeof(address));
+}
+
+static Value readReadyNative(int argCount, Value* args) {
+    int fd = (int)AS_NUMBER(args[0]);
+    char buffer[IO_READ_MAX];
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count == -1 && wouldBlock()) {
+        return ioBlock(fd, EPOLLIN, readReadyNative, argCount, args);
+    }
+    if (count <= 0) return NIL_VAL;
+    return OBJ_VAL(copyString(buffer, (int)count));
+}
+
+// read(socket) returns the next chunk of data, or nil at the end.
+Value readNative(int argCount, Value* args) {
+    if (!isSocket(args[0])) return nativeError("read() takes a socket.");
+    return readReadyNative(argCount, args);
+}
+
+// Writes `text` from `offset` on, waiting for room as often as needed.
+static Value writeFrom(Value fd, Value text, int offset);
+
+static Value writeRestNative(int argCount, Value* args) {
+    (void)argCount;
+    return writeFrom(args[0], args[1], (int)AS_NUMBER(args[2]));
+}
+
+static Value writeFrom(Value fd, Value text, int offset) {
+    int descriptor = (int)AS_NUMBER(fd);
+    ObjString* string = AS_STRING(text);
+
+    while (offset < string->length) {
+        // send() keeps a closed peer from killing us with SIGPIPE.
+        const char* start = string->chars + offset;
+        ssize_t count = send(descriptor, start, string->length - offset,
+                             MSG_NOSIGNAL);
+        if (count == -1) {
+            if (wouldBlock()) {
+                Value rest[3] = {fd, text, NUMBER_VAL(offset)};
+                return ioBlock(descriptor, EPOLLOUT, writeRestNative, 3, rest);
+            }
+            return offset > 0 ? NUMBER_VAL(offset) : NIL_VAL;
+        }
+        offset += (int)count;
+    }
+    return NUMBER_VAL(offset);
+}
+
+/**
+ * write(socket, string) returns the number of bytes written, which is all of
+ * them unless an error occurs.
+ */
+Value writeNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!isSocket(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("write() takes a socket and a string.");
+    }
+    return writeFrom(args[0], args[1], 0);
+}
+
+/**
+ * close(socket) closes a socket that listen(), accept() or connect()
+ * returned. Closing it wakes the fibers waiting on it with nil.
+ */
+Value closeNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!isDescriptor(args[0]) || !removeSocket((int)AS_NUMBER(args[0]))) {
+        return nativeError("close() takes an open socket.");
+    }
+
+    int fd = (int)AS_NUMBER(args[0]);
+    Loop* loop = &vm.loop;
+    while (fd < loop->waitCapacity && loop->waits[fd].head != NULL) {
+        ObjFiber* fiber = loop->waits[fd].head->fiber;
+        unpark(fd, loop->waits[fd].head);
+        finishWait(fiber, NIL_VAL);
+    }
+    close(fd);
+    return NIL_VAL;
+}
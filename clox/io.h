@@ -0,0 +1,86 @@
+#ifndef clox_io_h
+#define clox_io_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * The event loop lets a fiber wait for a file descriptor without blocking
+ * the process. Every descriptor the I/O natives create is non-blocking.
+ * When an operation would block, the native records how to retry it with
+ * ioBlock() and returns; the VM then parks the calling fiber and runs one
+ * that is ready. Once epoll reports the descriptor ready, the retry is
+ * called and what it returns becomes the result of the original call.
+ *
+ * Any number of fibers can wait on one descriptor, a reader and a writer on
+ * a socket or several receivers on a channel, say. epoll watches for the
+ * union of the events they wait for, and when some of those are reported
+ * the waiters that asked for them are retried oldest first.
+ *
+ * Fibers passed to schedule() run as tasks on the same loop. They get to
+ * run whenever the running fiber waits, and interpret() doesn't return
+ * until every task has finished.
+ *
+ * Regular files can't be waited on with epoll, so readFile() and
+ * writeFile() complete synchronously.
+ */
+
+#define IO_ARGS_MAX 3
+
+typedef struct IoWait {
+    ObjFiber* fiber;
+    uint32_t events;
+    NativeFn retry;
+    int argCount;
+    Value args[IO_ARGS_MAX];
+    struct IoWait* next;
+} IoWait;
+
+// The fibers waiting on one descriptor, oldest first.
+typedef struct {
+    IoWait* head;
+    IoWait* tail;
+    uint32_t events; // What epoll watches the descriptor for.
+} IoWaiters;
+
+typedef struct {
+    int epollFd; // Created the first time a fiber waits.
+    // Indexed by descriptor.
+    IoWaiters* waits;
+    int waitCapacity;
+    int waitCount; // Waiting fibers, on every descriptor.
+    // Fibers that can run, oldest first, linked through nextReady.
+    ObjFiber* readyHead;
+    ObjFiber* readyTail;
+    // Filled in by ioBlock() for the VM to pick up after the native returns.
+    bool blocked;
+    int blockFd;
+    IoWait block;
+} Loop;
+
+void initLoop(Loop* loop);
+void freeLoop(Loop* loop);
+void markLoop(Loop* loop);
+Value ioBlock(int fd, uint32_t events, NativeFn retry,
+              int argCount, Value* args);
+bool ioPark(ObjFiber* fiber);
+ObjFiber* ioNextFiber();
+void ioReset();
+
+Value scheduleNative(int argCount, Value* args);
+Value sleepNative(int argCount, Value* args);
+Value readFileNative(int argCount, Value* args);
+Value writeFileNative(int argCount, Value* args);
+Value listenNative(int argCount, Value* args);
+Value listenUnixNative(int argCount, Value* args);
+Value acceptNative(int argCount, Value* args);
+Value connectNative(int argCount, Value* args);
+Value connectUnixNative(int argCount, Value* args);
+Value readNative(int argCount, Value* args);
+Value writeNative(int argCount, Value* args);
+Value closeNative(int argCount, Value* args);
+
+#endif
@@ -0,0 +1,290 @@
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "library.h"
+#include "memory.h"
+#include "native.h"
+#include "search.h"
+#include "vm.h"
+
+/**
+ * The math natives share two C functions and find the libm function to
+ * call, and their own name for error messages, in their native data.
+ */
+
+typedef struct {
+    const char* name;
+    double (*function)(double);
+} UnaryMath;
+
+typedef struct {
+    const char* name;
+    double (*function)(double, double);
+} BinaryMath;
+
+static const UnaryMath unaryMath[] = {
+    {"abs", fabs},
+    {"acos", acos},
+    {"asin", asin},
+    {"atan", atan},
+    {"ceil", ceil},
+    {"cos", cos},
+    {"exp", exp},
+    {"floor", floor},
+    {"log", log},
+    {"round", round},
+    {"sin", sin},
+    {"sqrt", sqrt},
+    {"tan", tan},
+    {"trunc", trunc},
+};
+
+static const BinaryMath binaryMath[] = {
+    {"atan2", atan2},
+    {"max", fmax},
+    {"min", fmin},
+    {"pow", pow},
+};
+
+static Value unaryMathNative(int argCount, Value* args) {
+    (void)argCount;
+    const UnaryMath* math = nativeData();
+    if (!IS_NUMBER(args[0])) {
+        return nativeError("%s() takes a number.", math->name);
+    }
+    return NUMBER_VAL(math->function(AS_NUMBER(args[0])));
+}
+
+static Value binaryMathNative(int argCount, Value* args) {
+    (void)argCount;
+    const BinaryMath* math = nativeData();
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        return nativeError("%s() takes two numbers.", math->name);
+    }
+    return NUMBER_VAL(math->function(AS_NUMBER(args[0]),
+                                     AS_NUMBER(args[1])));
+}
+
+static bool isIndex(Value value) {
+    return IS_NUMBER(value) && fabs(AS_NUMBER(value)) <= INT_MAX &&
+           AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+// len(value) returns the number of bytes in a string or items in a list.
+static Value lenNative(int argCount, Value* args) {
+    (void)argCount;
+    if (IS_STRING(args[0])) return NUMBER_VAL(AS_STRING(args[0])->length);
+    if (IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    return nativeError("len() takes a string or a list.");
+}
+
+/**
+ * indexOf(string, needle, start) returns the offset of the first
+ * occurrence of `needle` at or after `start`, which defaults to 0, or -1
+ * if there is none.
+ */
+static Value indexOfNative(int argCount, Value* args) {
+    if (argCount < 2 || argCount > 3) {
+        return nativeError("Expected 2 or 3 arguments but got %d.", argCount);
+    }
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("indexOf() takes two strings.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* needle = AS_STRING(args[1]);
+
+    int start = 0;
+    if (argCount == 3) {
+        if (!isIndex(args[2])) {
+            return nativeError("indexOf() takes a whole number start.");
+        }
+        start = (int)AS_NUMBER(args[2]);
+        if (start < 0) start = 0;
+        if (start > string->length) return NUMBER_VAL(-1);
+    }
+
+    int found = findBytes(string->chars + start, string->length - start,
+                          needle->chars, needle->length);
+    return NUMBER_VAL(found == -1 ? -1 : start + found);
+}
+
+/**
+ * split(string, separator) returns a list of the pieces of `string`
+ * between occurrences of `separator`. An empty separator splits it into
+ * single bytes.
+ */
+static Value splitNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        return nativeError("split() takes two strings.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* separator = AS_STRING(args[1]);
+
+    // Keep the list and each new piece on the stack so the GC can see them
+    // while the list grows.
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+
+    int start = 0;
+    if (separator->length == 0) {
+        for (; start < string->length; start++) {
+            push(OBJ_VAL(copyString(string->chars + start, 1)));
+            writeValueArray(&list->items, vm.stackTop[-1]);
+            pop();
+        }
+        return pop();
+    }
+
+    for (;;) {
+        int found = findBytes(string->chars + start, string->length - start,
+                              separator->chars, separator->length);
+        int end = found == -1 ? string->length : start + found;
+        push(OBJ_VAL(copyString(string->chars + start, end - start)));
+        writeValueArray(&list->items, vm.stackTop[-1]);
+        pop();
+        if (found == -1) break;
+        start = end + separator->length;
+    }
+    return pop();
+}
+
+/**
+ * substring(string, start, end) returns the bytes in [start, end). `end`
+ * defaults to the length of the string.
+ */
+static Value substringNative(int argCount, Value* args) {
+    if (argCount < 2 || argCount > 3) {
+        return nativeError("Expected 2 or 3 arguments but got %d.", argCount);
+    }
+    if (!IS_STRING(args[0])) {
+        return nativeError("substring() takes a string.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+
+    if (!isIndex(args[1]) || (argCount == 3 && !isIndex(args[2]))) {
+        return nativeError("substring() takes whole number bounds.");
+    }
+    int start = (int)AS_NUMBER(args[1]);
+    int end = argCount == 3 ? (int)AS_NUMBER(args[2]) : string->length;
+    if (start < 0 || end < start || end > string->length) {
+        return nativeError("Substring bounds out of range.");
+    }
+
+    return OBJ_VAL(copyString(string->chars + start, end - start));
+}
+
+// replace(string, old, new) replaces every occurrence of `old`.
+static Value replaceNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]) || !IS_STRING(args[2])) {
+        return nativeError("replace() takes three strings.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* from = AS_STRING(args[1]);
+    ObjString* to = AS_STRING(args[2]);
+    if (from->length == 0) {
+        return nativeError("Can't replace an empty string.");
+    }
+
+    int count = 0;
+    for (int start = 0;;) {
+        int found = findBytes(string->chars + start, string->length - start,
+                              from->chars, from->length);
+        if (found == -1) break;
+        count++;
+        start += found + from->length;
+    }
+    if (count == 0) return args[0];
+
+    int64_t length = string->length +
+                     (int64_t)count * (to->length - from->length);
+    if (length > INT_MAX - 1) {
+        return nativeError("replace() would make a string too long.");
+    }
+    char* chars = ALLOCATE(char, length + 1);
+    char* out = chars;
+    for (int start = 0;;) {
+        int found = findBytes(string->chars + start, string->length - start,
+                              from->chars, from->length);
+        int end = found == -1 ? string->length : start + found;
+        memcpy(out, string->chars + start, end - start);
+        out += end - start;
+        if (found == -1) break;
+        memcpy(out, to->chars, to->length);
+        out += to->length;
+        start = end + from->length;
+    }
+    chars[length] = '\0';
+    return OBJ_VAL(takeString(chars, (int)length));
+}
+
+/**
+ * str(value) converts nil, a boolean, a number or a string to a string.
+ * Numbers get the shortest text that reads back as the same number, so
+ * num(str(x)) == x.
+ */
+static Value strNative(int argCount, Value* args) {
+    (void)argCount;
+    Value value = args[0];
+    if (IS_STRING(value)) return value;
+    if (IS_NIL(value)) return OBJ_VAL(copyString("nil", 3));
+    if (IS_BOOL(value)) {
+        return AS_BOOL(value) ? OBJ_VAL(copyString("true", 4))
+                              : OBJ_VAL(copyString("false", 5));
+    }
+    if (!IS_NUMBER(value)) {
+        return nativeError("str() takes nil, a boolean, a number or a string.");
+    }
+
+    double number = AS_NUMBER(value);
+    char buffer[32];
+    int length = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        length = snprintf(buffer, sizeof(buffer), "%.*g", precision, number);
+        if (strtod(buffer, NULL) == number || isnan(number)) break;
+    }
+    return OBJ_VAL(copyString(buffer, length));
+}
+
+/**
+ * num(string) parses a decimal number, allowing surrounding whitespace.
+ * Returns nil if the string isn't one.
+ */
+static Value numNative(int argCount, Value* args) {
+    (void)argCount;
+    if (IS_NUMBER(args[0])) return args[0];
+    if (!IS_STRING(args[0])) return nativeError("num() takes a string.");
+
+    ObjString* string = AS_STRING(args[0]);
+    char* end;
+    double number = strtod(string->chars, &end);
+    if (end == string->chars) return NIL_VAL;
+    while (*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n') end++;
+    // Strings can contain '\0', so check the whole string was read.
+    if (end != string->chars + string->length) return NIL_VAL;
+    return NUMBER_VAL(number);
+}
+
+void defineLibrary() {
+    for (size_t i = 0; i < sizeof(unaryMath) / sizeof(unaryMath[0]); i++) {
+        defineNative(unaryMath[i].name, unaryMathNative, 1,
+                     (void*)&unaryMath[i]);
+    }
+    for (size_t i = 0; i < sizeof(binaryMath) / sizeof(binaryMath[0]); i++) {
+        defineNative(binaryMath[i].name, binaryMathNative, 2,
+                     (void*)&binaryMath[i]);
+    }
+
+    defineNative("len", lenNative, 1, NULL);
+    defineNative("indexOf", indexOfNative, NATIVE_VARIADIC, NULL);
+    defineNative("split", splitNative, 2, NULL);
+    defineNative("substring", substringNative, NATIVE_VARIADIC, NULL);
+    defineNative("replace", replaceNative, 3, NULL);
+    defineNative("str", strNative, 1, NULL);
+    defineNative("num", numNative, 1, NULL);
+}
@@ -0,0 +1,12 @@
+#ifndef clox_library_h
+#define clox_library_h
+
+/**
+ * The standard library: math functions, string search and manipulation,
+ * and conversions between numbers and strings. They are ordinary natives,
+ * defined as globals by initVM().
+ */
+
+void defineLibrary();
+
+#endif
@@ -5,6 +5,11 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "native.h"
+#include "profile.h"
+#include "sample.h"
+#include "source.h"
+#include "trace.h"
 #include "vm.h"
 
 static void repl() {
@@ -21,51 +26,14 @@ static void repl() {
     }
 }
 
-/**
- * We want to allocate a big enough string to read the whole file, but we don't
- * know how big the file is until we have read it.
- * 1. We open the file ("rb" means the file is in binary. Not sure why it's needed)
- * 2. We call fseek with 0l (long integer value with all the bits set to zero - generally the definition of 0)
- *    and SEEK_END to reach the end of the file.
- * 3. Then we call ftell, which tells us how many bytes we are from the start of the file.
- *    Since we seeked (sought?) to the end, that's the size.
- * 4. We rewind back to the beginning.
- * 5. Allocate a string of fileSize.
- * 6. Read the whole file in a single batch.
- */
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    // File doesn't exist, or user doesn't have access to it.
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
-
-    fseek(file, 0l, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
-
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
+static void runFile(const char* path) {
+    Source source;
+    if (!openSource(&source, path)) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
     }
-
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
-}
-
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result = interpret(source.chars);
+    closeSource(&source);
 
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
@@ -73,16 +41,110 @@ static void runFile(const char* path) {
         exit(70);
 }
 
+static void usage() {
+#ifdef DEBUG
+    fprintf(stderr, "Usage: clox [--print-code] [--trace] [--log-gc] "
+                    "[--trace-file path] [--profile] [--profile-folded path] "
+                    "[--sample path] [--sample-rate hz] "
+                    "[--native library]... [path]\n");
+#else
+    fprintf(stderr, "Usage: clox [--trace-file path] [--profile] "
+                    "[--profile-folded path] [--sample path] "
+                    "[--sample-rate hz] [--native library]... [path]\n");
+#endif
+    exit(64);
+}
+
+static void startTrace(const char* path) {
+    if (!openTrace(path)) {
+        fprintf(stderr, "Could not open trace file \"%s\".\n", path);
+        exit(74);
+    }
+    // Scripts that fail leave through exit(), which must flush the trace.
+    atexit(closeTrace);
+}
+
 int main(int argc, const char* argv[]) {
     initVM();
+#ifdef INSTRUMENT_OPCODES
+    // Scripts that fail leave through exit(), so report from an exit handler.
+    atexit(printOpcodeCounts);
+#endif
+
+    // Extensions are loaded first so that the script can use their natives.
+    int arg = 1;
+    const char* tracePath = getenv(TRACE_ENV);
+    bool profileReport = false;
+    const char* foldedPath = NULL;
+    const char* samplePath = getenv(SAMPLE_ENV);
+    int sampleRate = SAMPLE_RATE_DEFAULT;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        if (strcmp(argv[arg], "--native") == 0 && arg + 1 < argc) {
+            if (!loadNativeLibrary(argv[arg + 1])) exit(74);
+            arg += 2;
+            continue;
+        }
+        if (strcmp(argv[arg], "--trace-file") == 0 && arg + 1 < argc) {
+            tracePath = argv[arg + 1];
+            arg += 2;
+            continue;
+        }
+        if (strcmp(argv[arg], "--profile") == 0) {
+            profileReport = true;
+            arg++;
+            continue;
+        }
+        if (strcmp(argv[arg], "--profile-folded") == 0 && arg + 1 < argc) {
+            foldedPath = argv[arg + 1];
+            arg += 2;
+            continue;
+        }
+        if (strcmp(argv[arg], "--sample") == 0 && arg + 1 < argc) {
+            samplePath = argv[arg + 1];
+            arg += 2;
+            continue;
+        }
+        if (strcmp(argv[arg], "--sample-rate") == 0 && arg + 1 < argc) {
+            sampleRate = atoi(argv[arg + 1]);
+            if (sampleRate <= 0) usage();
+            arg += 2;
+            continue;
+        }
+#ifdef DEBUG
+        if (strcmp(argv[arg], "--print-code") == 0) {
+            debugOptions.printCode = true;
+        } else if (strcmp(argv[arg], "--trace") == 0) {
+            debugOptions.traceExecution = true;
+        } else if (strcmp(argv[arg], "--log-gc") == 0) {
+            debugOptions.logGC = true;
+        } else {
+            usage();
+        }
+        arg++;
+#else
+        usage();
+#endif
+    }
+
+    if (tracePath != NULL && tracePath[0] != '\0') startTrace(tracePath);
+    if (profileReport || foldedPath != NULL) {
+        startProfile(profileReport, foldedPath);
+        atexit(stopProfile);
+    }
+    if (samplePath != NULL && samplePath[0] != '\0') {
+        if (!startSampler(samplePath, sampleRate)) {
+            fprintf(stderr, "Could not start the sampling profiler.\n");
+            exit(70);
+        }
+        atexit(stopSampler);
+    }
 
-    if (argc == 1) {
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        printf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
@@ -3,6 +3,7 @@
 #include "compiler.h"
 #include "memory.h"
 #include "vm.h"
+#include "worker.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -45,9 +46,11 @@ static void markArray(ValueArray* array) {
 
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p blacken ", (void*)object);
-  printValue(OBJ_VAL(object));
-  printf("\n");
+  if (debugOptions.logGC) {
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+  }
 #endif
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
@@ -70,9 +73,28 @@ static void blackenObject(Obj* object) {
       }
       break;
     }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)object;
+      markObject((Obj*)fiber->caller);
+      // The running fiber's state lives in the VM and is marked by
+      // markRoots(); what is stored in the fiber itself is stale.
+      if (fiber == vm.fiber) break;
+
+      for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(*slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        markObject((Obj*)fiber->frames[i].closure);
+      }
+      for (int i = 0; i < fiber->openUpvalueTop; i++) {
+        markObject((Obj*)fiber->openUpvalues[i]);
+      }
+      break;
+    }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
+      markObject((Obj*)function->closure);
       markArray(&function->chunk.constants);
       break;
     }
@@ -82,11 +104,17 @@ static void blackenObject(Obj* object) {
       markTable(&instance->fields);
       break;
     }
+    case OBJ_LIST:
+      markArray(&((ObjList*)object)->items);
+      break;
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
+    case OBJ_CHANNEL:
     case OBJ_NATIVE:
+    case OBJ_RANGE:
     case OBJ_STRING:
+    case OBJ_WORKER:
       break;
   }
 }
@@ -96,9 +124,11 @@ void markObject(Obj* object) {
     if (object->isMarked) return;
 
 #ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
+    if (debugOptions.logGC) {
+      printf("%p mark ", (void*)object);
+      printValue(OBJ_VAL(object));
+      printf("\n");
+    }
 #endif
 
     object->isMarked = true;
@@ -116,13 +146,19 @@ void markObject(Obj* object) {
 
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
+    if (debugOptions.logGC) {
+      printf("%p free type %d\n", (void*)object, object->type);
+    }
 #endif
 
     switch (object->type) {
       case OBJ_BOUND_METHOD:
         FREE(ObjBoundMethod, object);
         break;
+      case OBJ_CHANNEL:
+        releaseChannel(((ObjChannel*)object)->channel);
+        FREE(ObjChannel, object);
+        break;
       case OBJ_CLASS: {
         ObjClass* klass = (ObjClass*)object;
         freeTable(&klass->methods);
@@ -131,9 +167,16 @@ static void freeObject(Obj* object) {
       }
       case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                     closure->upvalueCount);
-        FREE(ObjClosure, object);
+        reallocate(object, sizeof(ObjClosure) +
+                   sizeof(ObjUpvalue*) * closure->upvalueCount, 0);
+        break;
+      }
+      case OBJ_FIBER: {
+        ObjFiber* fiber = (ObjFiber*)object;
+        free(fiber->frames);
+        free(fiber->stack);
+        free(fiber->openUpvalues);
+        FREE(ObjFiber, object);
         break;
       }
       case OBJ_FUNCTION: {
@@ -148,10 +191,19 @@ static void freeObject(Obj* object) {
         FREE(ObjInstance, object);
         break;
       }
+      case OBJ_LIST: {
+        ObjList* list = (ObjList*)object;
+        freeValueArray(&list->items);
+        FREE(ObjList, object);
+        break;
+      }
       case OBJ_NATIVE: {
         FREE(ObjNative, object);
         break;
       }
+      case OBJ_RANGE:
+        FREE(ObjRange, object);
+        break;
       case OBJ_STRING: {
         ObjString* string = (ObjString*)object;
         FREE_ARRAY(char, string->chars, string->length + 1);
@@ -161,6 +213,10 @@ static void freeObject(Obj* object) {
       case OBJ_UPVALUE:
         FREE(ObjUpvalue, object);
         break;
+      case OBJ_WORKER:
+        releaseWorker(((ObjWorker*)object)->worker);
+        FREE(ObjWorker, object);
+        break;
   }
 }
 
@@ -173,15 +229,17 @@ static void markRoots() {
         markObject((Obj*)vm.frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues;
-         upvalue != NULL;
-         upvalue = upvalue->next) {
-      markObject((Obj*)upvalue);
+    for (int i = 0; i < vm.openUpvalueTop; i++) {
+        markObject((Obj*)vm.openUpvalues[i]);
     }
 
+    markObject((Obj*)vm.fiber);
+    markObject((Obj*)vm.mainFiber);
+    markLoop(&vm.loop);
     markTable(&vm.globals);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.nativeCall);
 }
 
 static void traceReferences() {
@@ -191,6 +249,31 @@ static void traceReferences() {
   }
 }
 
+/**
+ * A closure can outlive the fiber whose variable it captured while that
+ * fiber was suspended. Before an unreachable fiber's stack is freed, its
+ * open upvalues are closed so they keep the values instead of pointing
+ * into freed memory. Upvalues that are about to be swept themselves are
+ * still allocated at this point, so closing those is harmless.
+ */
+static void closeDeadFibers() {
+  ObjFiber** fiber = &vm.fibers;
+  while (*fiber != NULL) {
+    if ((*fiber)->obj.isMarked) {
+      fiber = &(*fiber)->nextFiber;
+      continue;
+    }
+
+    for (int i = 0; i < (*fiber)->openUpvalueTop; i++) {
+      ObjUpvalue* upvalue = (*fiber)->openUpvalues[i];
+      if (upvalue == NULL) continue;
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+    }
+    *fiber = (*fiber)->nextFiber;
+  }
+}
+
 static void sweep() {
   Obj* previous = NULL;
   Obj* object = vm.objects;
@@ -215,22 +298,25 @@ static void sweep() {
 
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    if (debugOptions.logGC) printf("-- gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
 
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  closeDeadFibers();
   sweep();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated,
-           vm.nextGC);
+    if (debugOptions.logGC) {
+      printf("-- gc end\n");
+      printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+             before - vm.bytesAllocated, before, vm.bytesAllocated,
+             vm.nextGC);
+    }
 #endif
 }
 
@@ -0,0 +1,54 @@
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "native.h"
+#include "vm.h"
+
+void defineNative(const char* name, NativeFn function, int arity, void* data) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    push(OBJ_VAL(newNative(function, arity, data)));
+    tableSet(&vm.globals, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+    vm.globalsChanged = true;
+    pop();
+    pop();
+}
+
+// Only meaningful while a native is running.
+void* nativeData() {
+    return vm.native == NULL ? NULL : vm.native->data;
+}
+
+Value nativeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm.nativeMessage, NATIVE_ERROR_MAX, format, args);
+    va_end(args);
+    vm.nativeFailed = true;
+    return NIL_VAL;
+}
+
+/**
+ * Loads an extension into the calling thread's VM. The library is never
+ * closed: its natives may be called, or copied to workers, at any time.
+ */
+bool loadNativeLibrary(const char* path) {
+    void* library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+
+    void (*open)(void);
+    *(void**)&open = dlsym(library, NATIVE_OPEN_SYMBOL);
+    if (open == NULL) {
+        fprintf(stderr, "\"%s\" does not define %s().\n",
+                path, NATIVE_OPEN_SYMBOL);
+        dlclose(library);
+        return false;
+    }
+
+    open();
+    return true;
+}
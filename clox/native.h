@@ -0,0 +1,41 @@
+#ifndef clox_native_h
+#define clox_native_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * The API for writing natives, used by the built-in ones and by extensions.
+ *
+ * A native is called with its arguments in place on the VM stack and
+ * returns its result. The VM has already checked the argument count
+ * against the arity it was defined with, unless that is NATIVE_VARIADIC.
+ * To fail, a native returns nativeError(...), which raises a runtime error
+ * in the calling script once the native has returned. nativeData() gives
+ * back the pointer the native was defined with, so one C function can
+ * serve several natives.
+ *
+ * nativeCall() calls a Lox value from inside a native and runs it to
+ * completion. The call can move the stack, which leaves the native's
+ * `args` dangling, so copy out what is still needed first. If the call
+ * fails, the error has been reported and the native should return at once;
+ * its return value is ignored. Code called this way can't yield or wait
+ * for I/O.
+ *
+ * An extension is a shared object that exports `void loxOpen(void)`, which
+ * defines its natives. `clox --native path.so` loads it at startup. It only
+ * links against these functions and the macros in value.h and object.h.
+ */
+
+#define NATIVE_VARIADIC -1
+#define NATIVE_ERROR_MAX 256
+#define NATIVE_OPEN_SYMBOL "loxOpen"
+
+void defineNative(const char* name, NativeFn function, int arity, void* data);
+void* nativeData();
+Value nativeError(const char* format, ...);
+bool nativeCall(Value callee, int argCount, Value* args, Value* result);
+bool loadNativeLibrary(const char* path);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -7,6 +8,10 @@
 #include "value.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
@@ -19,7 +24,9 @@ static Obj* allocateObject(size_t size, ObjType type) {
     vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %d\n", (void*)object, size, type);
+    if (debugOptions.logGC) {
+        printf("%p allocate %zu for %d\n", (void*)object, size, type);
+    }
 #endif
 
     return object;
@@ -41,29 +48,89 @@ ObjClass* newClass(ObjString* name) {
   return klass;
 }
 
+/**
+ * The upvalues are stored inline, after the closure. A function that
+ * captures nothing gets the same closure every time, made the first time
+ * it is asked for, so creating one in a loop doesn't allocate.
+ */
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                     function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
+    if (function->closure != NULL) return function->closure;
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount,
+        OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
+    if (function->upvalueCount == 0) function->closure = closure;
     return closure;
 }
 
+/**
+ * Creates a fiber that will run `closure` when first resumed, or, with a
+ * NULL closure, the main fiber the VM starts out on. Like the VM's stacks,
+ * the fiber's stacks are malloc'ed outside the GC heap.
+ */
+ObjFiber* newFiber(ObjClosure* closure) {
+    int frameCapacity = closure == NULL ? FRAMES_INITIAL : FIBER_FRAMES_INITIAL;
+    int stackCapacity = closure == NULL ? STACK_INITIAL : FIBER_STACK_INITIAL;
+    if (closure != NULL &&
+        closure->function->slotCount + STACK_SLACK > stackCapacity) {
+        stackCapacity = closure->function->slotCount + STACK_SLACK;
+    }
+    CallFrame* frames = (CallFrame*)malloc(sizeof(CallFrame) * frameCapacity);
+    Value* stack = (Value*)malloc(sizeof(Value) * stackCapacity);
+    if (frames == NULL || stack == NULL) exit(1);
+
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->state = closure == NULL ? FIBER_RUNNING : FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = frameCapacity;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = stackCapacity;
+    fiber->openUpvalues = NULL;
+    fiber->openUpvalueTop = 0;
+    fiber->nativeCalls = 0;
+    fiber->nextReady = NULL;
+
+    if (closure != NULL) {
+        *fiber->stackTop++ = OBJ_VAL(closure);
+        CallFrame* frame = &fiber->frames[fiber->frameCount++];
+        frame->closure = closure;
+        frame->ip = closure->function->chunk.code;
+        frame->slots = fiber->stack;
+    }
+
+    fiber->nextFiber = vm.fibers;
+    vm.fibers = fiber;
+    return fiber;
+}
+
 ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->slotCount = 0;
   function->name = NULL;
+  function->traceId = 0;
+  function->profileId = 0;
+  function->sampleId = 0;
+  function->closure = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
+ObjChannel* newChannel(Channel* channel) {
+  ObjChannel* handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+  handle->channel = channel;
+  return handle;
+}
+
 ObjInstance* newInstance(ObjClass* klass) {
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
@@ -71,12 +138,28 @@ ObjInstance* newInstance(ObjClass* klass) {
   return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjList* newList() {
+  ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  list->imageId = 0;
+  return list;
+}
+
+ObjNative* newNative(NativeFn function, int arity, void* data) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->data = data;
     return native;
 }
 
+ObjRange* newRange(double start, double end) {
+  ObjRange* range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
+  range->start = start;
+  range->end = end;
+  return range;
+}
+
 static ObjString* allocateString(char* chars, int length, uint32_t hash) {
   ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
@@ -131,10 +214,24 @@ ObjUpvalue* newUpValue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 }
 
+ObjWorker* newWorker(Worker* worker) {
+  ObjWorker* handle = ALLOCATE_OBJ(ObjWorker, OBJ_WORKER);
+  handle->worker = worker;
+  return handle;
+}
+
+static void printList(ObjList* list) {
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) printf(", ");
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+}
+
 static void printFunction(ObjFunction* function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -148,12 +245,18 @@ void printObject(Value value) {
     case OBJ_BOUND_METHOD:
       printFunction(AS_BOUND_METHOD(value)->method->function);
       break;
+    case OBJ_CHANNEL:
+      printf("<channel>");
+      break;
     case OBJ_CLASS:
       printf("%s", AS_CLASS(value)->name->chars);
       break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
+    case OBJ_FIBER:
+      printf("<fiber>");
+      break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
@@ -161,15 +264,24 @@ void printObject(Value value) {
       printf("%s instance",
       AS_INSTANCE(value)->klass->name->chars);
         break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
+      break;
     case OBJ_NATIVE: {
       printf("<native fn>");
       break;
       }
+    case OBJ_RANGE:
+      printf("%g..%g", AS_RANGE(value)->start, AS_RANGE(value)->end);
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
+    case OBJ_WORKER:
+      printf("<worker>");
+      break;
   }
 }
\ No newline at end of file
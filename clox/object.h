@@ -9,32 +9,46 @@
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)      isObjType(value, OBJ_CHANNEL)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_RANGE(value)        isObjType(value, OBJ_RANGE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_WORKER(value)       isObjType(value, OBJ_WORKER)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CHANNEL(value)      ((ObjChannel*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_RANGE(value)        ((ObjRange*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_WORKER(value)       ((ObjWorker*)AS_OBJ(value))
 
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_RANGE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_WORKER
 } ObjType;
 
 // next prop is used by freeObjects for memory clean up (a first attempt at a garbage collector)
@@ -49,14 +63,28 @@ typedef struct {
     int arity;
     Chunk chunk;
     int upvalueCount;
+    // The most stack slots a call uses at once: the callee, its parameters
+    // and locals, and temporaries. See maxStackDepth() in compiler.c.
+    int slotCount;
     ObjString* name;
+    // Identifies the function in a trace file, or 0 before it is traced.
+    uint32_t traceId;
+    // Its entry in the profile plus one, or 0 before it is profiled.
+    int profileId;
+    // Its name in the sampler's table, or 0 before it is first sampled.
+    int sampleId;
+    // The one closure of a function that captures nothing. See newClosure().
+    struct ObjClosure* closure;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
 
+// See native.h.
 typedef struct {
     Obj obj;
     NativeFn function;
+    int arity;
+    void* data;
 } ObjNative;
 
 struct ObjString {
@@ -70,16 +98,65 @@ typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* ip;
+    Value* slots;
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW,
+    FIBER_RUNNING,
+    FIBER_SUSPENDED,
+    FIBER_DONE
+} FiberState;
+
+/**
+ * A fiber is a separate call stack that can be suspended with `yield` and
+ * resumed later by calling the fiber like a function. Calling it passes one
+ * value in, which becomes the result of the `yield` it is suspended at (or
+ * the argument of its function, the first time). It runs until it yields
+ * or returns, and that value is the result of the call.
+ *
+ * Open upvalues point into the stack of the fiber that owns the variable,
+ * so each fiber keeps its own. They are indexed by stack slot, which finds
+ * the upvalue of a captured variable and the ones a return has to close
+ * without a search.
+ */
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    // The fiber that resumed this one and gets control back when it yields.
+    struct ObjFiber* caller;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    // stackCapacity entries, or NULL until the fiber first captures a
+    // variable. No slot at or above openUpvalueTop has an open upvalue.
+    ObjUpvalue** openUpvalues;
+    int openUpvalueTop;
+    // Calls natives have made back into Lox that are still running on this
+    // fiber. Their C frames have to be returned to here, so until they are
+    // done the fiber can't yield or wait for I/O.
+    int nativeCalls;
+    // All fibers of the VM, so the GC can close the upvalues of dead ones.
+    struct ObjFiber* nextFiber;
+    // The event loop's queue of fibers that are ready to run.
+    struct ObjFiber* nextReady;
+} ObjFiber;
+
 typedef struct {
   Obj obj;
   ObjString* name;
@@ -98,17 +175,60 @@ typedef struct {
   ObjClosure* method;
 } ObjBoundMethod;
 
+typedef struct {
+  Obj obj;
+  ValueArray items;
+  // The last globals image the list was frozen into (see worker.h).
+  // Storing into it while that is still vm.globalsImageId makes the
+  // image stale.
+  int imageId;
+} ObjList;
+
+/**
+ * A half-open interval of numbers [start, end), created by the `..` operator.
+ * Ranges are only ever walked by `for (var x in ...)`, which steps by one.
+ */
+typedef struct {
+  Obj obj;
+  double start;
+  double end;
+} ObjRange;
+
+typedef struct Channel Channel;
+typedef struct Worker Worker;
+typedef struct GlobalsImage GlobalsImage;
+
+/**
+ * Handles on a channel or a worker (see worker.h). Those live outside any
+ * VM and are reference counted; each handle holds one reference, which is
+ * released when the handle is freed.
+ */
+typedef struct {
+  Obj obj;
+  Channel* channel;
+} ObjChannel;
+
+typedef struct {
+  Obj obj;
+  Worker* worker;
+} ObjWorker;
+
 ObjBoundMethod* newBoundMethod(Value receiver,
                                ObjClosure* method);
+ObjChannel* newChannel(Channel* channel);
 
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjFiber* newFiber(ObjClosure* closure);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
-ObjNative* newNative(NativeFn function);
+ObjList* newList();
+ObjNative* newNative(NativeFn function, int arity, void* data);
+ObjRange* newRange(double start, double end);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpValue(Value* slot);
+ObjWorker* newWorker(Worker* worker);
 void printObject(Value value);
 
 /**
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profile.h"
+#include "timer.h"
+#include "vm.h"
+
+#define PROFILE_LINES_SHOWN 20
+
+typedef struct {
+    // Copied, since the function may be collected before the report.
+    char* name;
+    uint64_t calls;
+    uint64_t instructions;
+    uint64_t inclusive; // Nanoseconds.
+    uint64_t exclusive;
+    // Activations on the shadow stack; only the outermost adds inclusive time.
+    int active;
+} FunctionProfile;
+
+/**
+ * A node in the calling context tree: one per distinct call stack. Node 0
+ * is the root, which stands for no function at all.
+ */
+typedef struct {
+    int function;
+    int parent;
+    int firstChild;
+    int nextSibling;
+    uint64_t self; // Nanoseconds on top of the stack.
+} StackNode;
+
+typedef struct {
+    // Only compared with the frames in vm.frames, never followed.
+    ObjClosure* closure;
+    int function;
+    int node;
+    uint64_t entered;
+    // The last instruction that ran with this frame on top.
+    uint8_t lastOpcode;
+} ShadowFrame;
+
+typedef struct {
+    uint64_t count;
+    int function; // The last function seen on the line.
+} LineProfile;
+
+typedef struct {
+    bool on;
+    bool report;
+    const char* foldedPath;
+
+    FunctionProfile* functions;
+    int functionCount;
+    int functionCapacity;
+    StackNode* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    ShadowFrame* stack;
+    int depth;
+    int stackCapacity;
+    LineProfile* lines;
+    int lineCapacity;
+    uint64_t opcodes[OPCODE_COUNT];
+    uint64_t instructions;
+
+    // The fiber whose frames the shadow stack mirrors.
+    ObjFiber* fiber;
+    uint64_t started;
+    // When the top of the shadow stack last changed.
+    uint64_t lastSwitch;
+} Profiler;
+
+static THREAD_LOCAL Profiler profiler;
+
+/**
+ * The profile is kept outside the VM's heap, like a SharedCode image, so
+ * that profiling doesn't change when the collector runs.
+ */
+static void* growProfileArray(void* array, int* capacity, int needed,
+                              size_t size) {
+    if (needed <= *capacity) return array;
+
+    int oldCapacity = *capacity;
+    while (*capacity < needed) *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    memset((char*)array + size * oldCapacity, 0,
+           size * (*capacity - oldCapacity));
+    return array;
+}
+
+static int functionIndex(ObjFunction* function) {
+    if (function->profileId != 0) return function->profileId - 1;
+
+    profiler.functions = growProfileArray(profiler.functions,
+        &profiler.functionCapacity, profiler.functionCount + 1,
+        sizeof(FunctionProfile));
+    FunctionProfile* profile = &profiler.functions[profiler.functionCount];
+    profile->name = strdup(function->name != NULL ? function->name->chars
+                                                  : "script");
+    if (profile->name == NULL) exit(1);
+
+    function->profileId = ++profiler.functionCount;
+    return profiler.functionCount - 1;
+}
+
+static int addNode(int parent, int function) {
+    profiler.nodes = growProfileArray(profiler.nodes, &profiler.nodeCapacity,
+                                      profiler.nodeCount + 1, sizeof(StackNode));
+    int node = profiler.nodeCount++;
+    StackNode* created = &profiler.nodes[node];
+    created->function = function;
+    created->parent = parent;
+    created->firstChild = -1;
+    created->nextSibling = -1;
+    created->self = 0;
+    if (parent != -1) {
+        created->nextSibling = profiler.nodes[parent].firstChild;
+        profiler.nodes[parent].firstChild = node;
+    }
+    return node;
+}
+
+static int childNode(int parent, int function) {
+    for (int node = profiler.nodes[parent].firstChild; node != -1;
+         node = profiler.nodes[node].nextSibling) {
+        if (profiler.nodes[node].function == function) return node;
+    }
+    return addNode(parent, function);
+}
+
+void startProfile(bool report, const char* foldedPath) {
+    memset(&profiler, 0, sizeof(profiler));
+    profiler.on = true;
+    profiler.report = report;
+    profiler.foldedPath = foldedPath;
+    profiler.started = monotonicNanos();
+    addNode(-1, -1);
+}
+
+bool profiling() {
+    return profiler.on;
+}
+
+// Charges the time since the last change to whatever is on top.
+static void chargeTop(uint64_t now) {
+    if (profiler.depth > 0) {
+        ShadowFrame* top = &profiler.stack[profiler.depth - 1];
+        uint64_t elapsed = now - profiler.lastSwitch;
+        profiler.nodes[top->node].self += elapsed;
+        profiler.functions[top->function].exclusive += elapsed;
+    }
+    profiler.lastSwitch = now;
+}
+
+static void enterFrame(ObjClosure* closure, uint64_t now) {
+    int function = functionIndex(closure->function);
+    int parent = profiler.depth > 0 ? profiler.stack[profiler.depth - 1].node : 0;
+
+    profiler.stack = growProfileArray(profiler.stack, &profiler.stackCapacity,
+                                      profiler.depth + 1, sizeof(ShadowFrame));
+    ShadowFrame* frame = &profiler.stack[profiler.depth++];
+    frame->closure = closure;
+    frame->function = function;
+    frame->node = childNode(parent, function);
+    frame->entered = now;
+    frame->lastOpcode = OP_CALL; // Never ends the frame.
+
+    FunctionProfile* profile = &profiler.functions[function];
+    profile->calls++;
+    profile->active++;
+}
+
+static void leaveFrame(uint64_t now) {
+    ShadowFrame* frame = &profiler.stack[--profiler.depth];
+    FunctionProfile* profile = &profiler.functions[frame->function];
+    if (--profile->active == 0) profile->inclusive += now - frame->entered;
+}
+
+/**
+ * Whether the frame at `index` is no longer the activation the shadow
+ * stack has there. The closure alone can't tell: a self tail call keeps
+ * it, and so does any new call of a function that captures nothing, since
+ * all of its calls share one closure.
+ */
+static bool frameReplaced(int index) {
+    ShadowFrame* shadow = &profiler.stack[index];
+    CallFrame* frame = &vm.frames[index];
+    if (shadow->closure != frame->closure) return true;
+    switch (shadow->lastOpcode) {
+        case OP_TAIL_CALL:
+            // A tail call to a native or a class leaves the frame as it was.
+            return index == vm.frameCount - 1 &&
+                   frame->ip == frame->closure->function->chunk.code;
+        case OP_EXIT:
+            // nativeCall() popped the frame and has called again since.
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Brings the shadow stack in line with the running fiber's frames.
+static void syncFrames() {
+    int keep = profiler.depth < vm.frameCount ? profiler.depth : vm.frameCount;
+    if (vm.fiber != profiler.fiber) {
+        keep = 0;
+    } else if (keep > 0 && frameReplaced(keep - 1)) {
+        keep--;
+    }
+    if (keep == profiler.depth && keep == vm.frameCount) return;
+
+    uint64_t now = monotonicNanos();
+    chargeTop(now);
+    while (profiler.depth > keep) leaveFrame(now);
+    profiler.fiber = vm.fiber;
+    while (profiler.depth < vm.frameCount) {
+        enterFrame(vm.frames[profiler.depth].closure, now);
+    }
+}
+
+void profileInstruction(ObjFunction* function, int offset) {
+    syncFrames();
+
+    uint8_t opcode = function->chunk.code[offset];
+    profiler.instructions++;
+    profiler.opcodes[opcode]++;
+    profiler.stack[profiler.depth - 1].lastOpcode = opcode;
+    int index = profiler.stack[profiler.depth - 1].function;
+    profiler.functions[index].instructions++;
+
+    int line = getLine(&function->chunk, offset);
+    profiler.lines = growProfileArray(profiler.lines, &profiler.lineCapacity,
+                                      line + 1, sizeof(LineProfile));
+    profiler.lines[line].count++;
+    profiler.lines[line].function = index;
+}
+
+static int compareExclusive(const void* a, const void* b) {
+    uint64_t x = profiler.functions[*(const int*)a].exclusive;
+    uint64_t y = profiler.functions[*(const int*)b].exclusive;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compareOpcodes(const void* a, const void* b) {
+    uint64_t x = profiler.opcodes[*(const int*)a];
+    uint64_t y = profiler.opcodes[*(const int*)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compareLines(const void* a, const void* b) {
+    uint64_t x = profiler.lines[*(const int*)a].count;
+    uint64_t y = profiler.lines[*(const int*)b].count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double share(uint64_t count) {
+    return profiler.instructions == 0 ? 0 : 100.0 * count / profiler.instructions;
+}
+
+static void printReport(uint64_t elapsed) {
+    fprintf(stderr, "== profile: %llu instructions in %.3f ms ==\n\n",
+            (unsigned long long)profiler.instructions, elapsed / 1e6);
+
+    // Indexes of the functions, opcodes or lines in the order printed.
+    int orderSize = OPCODE_COUNT;
+    if (profiler.functionCount > orderSize) orderSize = profiler.functionCount;
+    if (profiler.lineCapacity > orderSize) orderSize = profiler.lineCapacity;
+    int* order = malloc(sizeof(int) * orderSize);
+    if (order == NULL) exit(1);
+
+    for (int i = 0; i < profiler.functionCount; i++) order[i] = i;
+    qsort(order, profiler.functionCount, sizeof(int), compareExclusive);
+    fprintf(stderr, "%-24s %10s %14s %7s %13s %13s\n", "function", "calls",
+            "instructions", "share", "inclusive ms", "exclusive ms");
+    for (int i = 0; i < profiler.functionCount; i++) {
+        FunctionProfile* profile = &profiler.functions[order[i]];
+        fprintf(stderr, "%-24s %10llu %14llu %6.2f%% %13.3f %13.3f\n",
+                profile->name, (unsigned long long)profile->calls,
+                (unsigned long long)profile->instructions,
+                share(profile->instructions),
+                profile->inclusive / 1e6, profile->exclusive / 1e6);
+    }
+
+    int count = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        if (profiler.opcodes[i] > 0) order[count++] = i;
+    }
+    qsort(order, count, sizeof(int), compareOpcodes);
+    fprintf(stderr, "\n%-24s %14s %7s\n", "opcode", "count", "share");
+    for (int i = 0; i < count; i++) {
+        uint64_t executed = profiler.opcodes[order[i]];
+        fprintf(stderr, "%-24s %14llu %6.2f%%\n", opcodeName(order[i]),
+                (unsigned long long)executed, share(executed));
+    }
+
+    count = 0;
+    for (int i = 0; i < profiler.lineCapacity; i++) {
+        if (profiler.lines[i].count > 0) order[count++] = i;
+    }
+    qsort(order, count, sizeof(int), compareLines);
+    if (count > PROFILE_LINES_SHOWN) count = PROFILE_LINES_SHOWN;
+    fprintf(stderr, "\n%-8s %14s %7s  %s\n", "line", "count", "share",
+            "function");
+    for (int i = 0; i < count; i++) {
+        LineProfile* line = &profiler.lines[order[i]];
+        fprintf(stderr, "%-8d %14llu %6.2f%%  %s\n", order[i],
+                (unsigned long long)line->count, share(line->count),
+                profiler.functions[line->function].name);
+    }
+
+    free(order);
+}
+
+static void writeStack(FILE* file, int node) {
+    int parent = profiler.nodes[node].parent;
+    if (parent != 0) {
+        writeStack(file, parent);
+        fputc(';', file);
+    }
+    fputs(profiler.functions[profiler.nodes[node].function].name, file);
+}
+
+static void writeFolded() {
+    FILE* file = fopen(profiler.foldedPath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile \"%s\".\n", profiler.foldedPath);
+        return;
+    }
+
+    for (int i = 1; i < profiler.nodeCount; i++) {
+        uint64_t micros = profiler.nodes[i].self / 1000;
+        if (micros == 0) continue;
+        writeStack(file, i);
+        fprintf(file, " %llu\n", (unsigned long long)micros);
+    }
+    fclose(file);
+}
+
+/**
+ * Closes every call still on the shadow stack, as if it returned now, and
+ * writes out what was asked for in startProfile().
+ */
+void stopProfile() {
+    if (!profiler.on) return;
+
+    uint64_t now = monotonicNanos();
+    chargeTop(now);
+    while (profiler.depth > 0) leaveFrame(now);
+    profiler.on = false;
+
+    if (profiler.report) printReport(now - profiler.started);
+    if (profiler.foldedPath != NULL) writeFolded();
+
+    for (int i = 0; i < profiler.functionCount; i++) {
+        free(profiler.functions[i].name);
+    }
+    free(profiler.functions);
+    free(profiler.nodes);
+    free(profiler.stack);
+    free(profiler.lines);
+}
@@ -0,0 +1,33 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * An opt-in profiler, for any build. While it is on, run() uses the same
+ * observed copy of its dispatch loop as tracing, and every instruction is
+ * counted by opcode, by function and by source line.
+ *
+ * Calls and returns are not hooked directly. Before each instruction the
+ * profiler compares its own shadow of the call stack with vm.frames, and
+ * the difference tells it which functions were entered or left. The clock
+ * is only read then, so straight-line code costs a counter update per
+ * instruction. A function's exclusive time is the time it spent on top of
+ * the stack; its inclusive time runs from its outermost activation to the
+ * matching return, so recursion isn't counted twice. When another fiber
+ * starts running, the stack of the previous one counts as left, and as
+ * called again when it resumes.
+ *
+ * --profile prints a report to stderr when the program exits, and
+ * --profile-folded path writes exclusive time in microseconds per call
+ * stack, in the collapsed format flamegraph.pl and speedscope read. Only
+ * the thread that started the profiler is profiled.
+ */
+
+void startProfile(bool report, const char* foldedPath);
+void stopProfile();
+bool profiling();
+void profileInstruction(ObjFunction* function, int offset);
+
+#endif
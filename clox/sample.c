@@ -0,0 +1,283 @@
+#define _GNU_SOURCE // For gettid() and SIGEV_THREAD_ID.
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sample.h"
+#include "vm.h"
+
+// glibc's sigevent has the field but not the name the man page uses.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Deeper stacks keep their innermost frames under a "..." frame.
+#define SAMPLE_DEPTH_MAX 64
+// Must be a power of two.
+#define SAMPLE_STACKS_MAX 4096
+#define SAMPLE_FRAMES_MAX (SAMPLE_STACKS_MAX * 16)
+#define SAMPLE_FUNCTIONS_MAX 4096
+#define SAMPLE_NAMES_SIZE (64 * 1024)
+
+typedef struct {
+    int function; // Index into the names; 0 is the "..." frame.
+    int line;
+} SampleFrame;
+
+typedef struct {
+    atomic_uint_least64_t count;
+    uint32_t hash;
+    int depth;
+    int start; // Of its frames in sampler.frames.
+    // Set once the fields above are filled in; they never change after.
+    atomic_bool ready;
+} SampleStack;
+
+/**
+ * The handler on the VM's thread is the only writer. writeSamples() may
+ * read at the same time from the thread that waits for SIGUSR2.
+ */
+typedef struct {
+    const char* path;
+    bool running;
+    timer_t timer;
+    pthread_mutex_t writeLock;
+
+    SampleStack* stacks;
+    SampleFrame* frames;
+    int frameCount;
+    // Function names, NUL-terminated, one after the other. names[i] is
+    // where the ith starts. functionCount is raised once a name is in.
+    char* nameChars;
+    int nameLength;
+    int* names;
+    atomic_int functionCount;
+    atomic_uint_least64_t dropped;
+} Sampler;
+
+static Sampler sampler = {.writeLock = PTHREAD_MUTEX_INITIALIZER};
+
+// Returns 0, the "..." frame, once there is no room for more names.
+static int sampledFunction(ObjFunction* function) {
+    if (function->sampleId != 0) return function->sampleId;
+
+    const char* name = "script";
+    int length = 6;
+    if (function->name != NULL) {
+        name = function->name->chars;
+        length = function->name->length;
+    }
+
+    int id = atomic_load_explicit(&sampler.functionCount, memory_order_relaxed);
+    if (id == SAMPLE_FUNCTIONS_MAX ||
+        sampler.nameLength + length + 1 > SAMPLE_NAMES_SIZE) {
+        return 0;
+    }
+
+    sampler.names[id] = sampler.nameLength;
+    memcpy(sampler.nameChars + sampler.nameLength, name, length);
+    sampler.nameChars[sampler.nameLength + length] = '\0';
+    sampler.nameLength += length + 1;
+    atomic_store_explicit(&sampler.functionCount, id + 1, memory_order_release);
+
+    function->sampleId = id;
+    return id;
+}
+
+static uint32_t hashFrames(SampleFrame* frames, int depth) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++) {
+        hash ^= (uint32_t)frames[i].function;
+        hash *= 16777619;
+        hash ^= (uint32_t)frames[i].line;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void recordStack(SampleFrame* frames, int depth) {
+    uint32_t hash = hashFrames(frames, depth);
+    for (int probe = 0; probe < SAMPLE_STACKS_MAX; probe++) {
+        SampleStack* stack = &sampler.stacks[(hash + probe) & (SAMPLE_STACKS_MAX - 1)];
+        if (atomic_load_explicit(&stack->ready, memory_order_relaxed)) {
+            if (stack->hash == hash && stack->depth == depth &&
+                memcmp(&sampler.frames[stack->start], frames,
+                       sizeof(SampleFrame) * depth) == 0) {
+                atomic_fetch_add_explicit(&stack->count, 1, memory_order_relaxed);
+                return;
+            }
+            continue;
+        }
+
+        if (sampler.frameCount + depth > SAMPLE_FRAMES_MAX) break;
+        memcpy(&sampler.frames[sampler.frameCount], frames,
+               sizeof(SampleFrame) * depth);
+        stack->hash = hash;
+        stack->depth = depth;
+        stack->start = sampler.frameCount;
+        sampler.frameCount += depth;
+        atomic_store_explicit(&stack->count, 1, memory_order_relaxed);
+        atomic_store_explicit(&stack->ready, true, memory_order_release);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&sampler.dropped, 1, memory_order_relaxed);
+}
+
+/**
+ * The SIGPROF handler. It interrupts the VM at an arbitrary point, so it
+ * gives up on the sample while the VM is replacing its frame array. Frames
+ * are complete before vm.frameCount counts them, and the closures in them
+ * are GC roots, so everything it follows is alive. A frame's ip may lag
+ * behind by an instruction or so, since run() keeps it in a register.
+ */
+static void takeSample(int signal, siginfo_t* info, void* context) {
+    (void)signal;
+    (void)info;
+    (void)context;
+
+    if (vm.framesChanging || vm.frames == NULL) {
+        atomic_fetch_add_explicit(&sampler.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    SampleFrame frames[SAMPLE_DEPTH_MAX];
+    int depth = 0;
+    int first = 0;
+    if (vm.frameCount > SAMPLE_DEPTH_MAX) {
+        first = vm.frameCount - (SAMPLE_DEPTH_MAX - 1);
+        frames[depth++] = (SampleFrame){0, 0};
+    }
+
+    for (int i = first; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        ObjFunction* function = frame->closure->function;
+        // ip is past the start of the instruction that is running.
+        int offset = (int)(frame->ip - function->chunk.code) - 1;
+        int line = 0;
+        if (offset >= 0 && offset < function->chunk.count) {
+            line = getLine(&function->chunk, offset);
+        }
+        frames[depth++] = (SampleFrame){sampledFunction(function), line};
+    }
+
+    if (depth > 0) recordStack(frames, depth);
+}
+
+static void writeSamples() {
+    pthread_mutex_lock(&sampler.writeLock);
+
+    FILE* file = fopen(sampler.path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write samples \"%s\".\n", sampler.path);
+        pthread_mutex_unlock(&sampler.writeLock);
+        return;
+    }
+
+    for (int i = 0; i < SAMPLE_STACKS_MAX; i++) {
+        SampleStack* stack = &sampler.stacks[i];
+        if (!atomic_load_explicit(&stack->ready, memory_order_acquire)) continue;
+
+        SampleFrame* frames = &sampler.frames[stack->start];
+        for (int j = 0; j < stack->depth; j++) {
+            if (j > 0) fputc(';', file);
+            fputs(sampler.nameChars + sampler.names[frames[j].function], file);
+            if (frames[j].function != 0) fprintf(file, ":%d", frames[j].line);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)
+                atomic_load_explicit(&stack->count, memory_order_relaxed));
+    }
+
+    uint64_t dropped = atomic_load(&sampler.dropped);
+    if (dropped > 0) fprintf(file, "[dropped] %llu\n", (unsigned long long)dropped);
+
+    fclose(file);
+    pthread_mutex_unlock(&sampler.writeLock);
+}
+
+static void* writeOnSignal(void* unused) {
+    (void)unused;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    for (;;) {
+        int signal;
+        if (sigwait(&signals, &signal) == 0) writeSamples();
+    }
+    return NULL;
+}
+
+static void* allocateSamples(size_t size) {
+    void* result = calloc(1, size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+/**
+ * Starts sampling the calling thread `rate` times per second of CPU time.
+ * Call it before any other thread is started, so that they all inherit
+ * SIGUSR2 blocked and leave it to the thread that writes the samples.
+ */
+bool startSampler(const char* path, int rate) {
+    sampler.path = path;
+    sampler.stacks = allocateSamples(sizeof(SampleStack) * SAMPLE_STACKS_MAX);
+    sampler.frames = allocateSamples(sizeof(SampleFrame) * SAMPLE_FRAMES_MAX);
+    sampler.nameChars = allocateSamples(SAMPLE_NAMES_SIZE);
+    sampler.names = allocateSamples(sizeof(int) * SAMPLE_FUNCTIONS_MAX);
+
+    // Name 0 is the frame that stands for those left out.
+    memcpy(sampler.nameChars, "...", 4);
+    sampler.nameLength = 4;
+    sampler.names[0] = 0;
+    atomic_store(&sampler.functionCount, 1);
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writeOnSignal, NULL) != 0) return false;
+    pthread_detach(writer);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = takeSample;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+    // A timer on this thread's CPU time, rather than setitimer()'s process
+    // timer, so that the signal always lands on the thread running the VM.
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler.timer) != 0) {
+        return false;
+    }
+
+    long interval = 1000000000L / rate;
+    struct itimerspec spec = {
+        .it_interval = {interval / 1000000000L, interval % 1000000000L},
+        .it_value = {interval / 1000000000L, interval % 1000000000L},
+    };
+    if (timer_settime(sampler.timer, 0, &spec, NULL) != 0) return false;
+
+    sampler.running = true;
+    return true;
+}
+
+void stopSampler() {
+    if (!sampler.running) return;
+
+    timer_delete(sampler.timer);
+    sampler.running = false;
+    writeSamples();
+}
@@ -0,0 +1,31 @@
+#ifndef clox_sample_h
+#define clox_sample_h
+
+#include "common.h"
+
+/**
+ * A sampling profiler cheap enough to leave on in production. A timer on
+ * the CPU time of the interpreter's thread raises SIGPROF, and the handler
+ * walks vm.frames and records the call stack as function names with the
+ * line each frame is on. Nothing runs between samples, so the dispatch
+ * loop is untouched.
+ *
+ * The handler never allocates. Stacks are aggregated in tables allocated
+ * up front; a stack that doesn't fit any more is counted as dropped.
+ * Entries are published with atomic stores, so the tables can be written
+ * out while the handler keeps adding to them, lock-free.
+ *
+ * Turn it on with --sample path (or CLOX_SAMPLE=path) and pick the rate
+ * with --sample-rate. The stacks are written to `path` in the folded
+ * format flamegraph.pl and speedscope read: when the program exits, and
+ * whenever the process gets SIGUSR2, so a long-running service can be
+ * looked at without stopping it.
+ */
+
+#define SAMPLE_ENV "CLOX_SAMPLE"
+#define SAMPLE_RATE_DEFAULT 100
+
+bool startSampler(const char* path, int rate);
+void stopSampler();
+
+#endif
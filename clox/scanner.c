@@ -4,17 +4,26 @@
 #include "common.h"
 #include "scanner.h"
 
+#ifdef X86_SIMD
+#include <emmintrin.h>
+#endif
+
 typedef struct {
     const char* start;
     const char* current;
+    // No byte in [current, limit) is the terminating '\0'. The limit is
+    // pushed forward a window at a time, so the scanner never reads far
+    // ahead of where it is and a mapped file is paged in as it goes.
+    const char* limit;
     int line;
 } Scanner;
 
-Scanner scanner;
+static THREAD_LOCAL Scanner scanner;
 
 void initScanner(const char* source) {
     scanner.start = source;
     scanner.current = source;
+    scanner.limit = source;
     scanner.line = 1;
 }
 
@@ -59,6 +68,94 @@ static bool match(char expected) {
     return true;
 }
 
+/**
+ * Long runs of whitespace, identifier characters and string contents are
+ * skipped a block of 16 bytes at a time: each compare classifies all 16
+ * bytes, and movemask turns the result into a bit per byte. The first zero
+ * bit is where the run ends. Newlines are counted the same way, so
+ * scanner.line stays right. Each function stops at the first byte that
+ * isn't part of the run, or when less than a block is left, and the
+ * byte-at-a-time loops that call it finish the job.
+ */
+#ifdef X86_SIMD
+
+#define BLOCK_SIZE 16
+#define LOOKAHEAD 4096
+
+// Returns true if a whole block can be loaded at the current position.
+static bool haveBlock() {
+    while (scanner.limit - scanner.current < BLOCK_SIZE) {
+        if (*scanner.limit == '\0') return false;
+        scanner.limit += strnlen(scanner.limit, LOOKAHEAD);
+    }
+    return true;
+}
+
+static __m128i loadBlock() {
+    return _mm_loadu_si128((const __m128i*)scanner.current);
+}
+
+static unsigned byteMask(__m128i block, char c) {
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Bit i is set if byte i is in [low, high]. Bytes over 0x7f never match.
+static __m128i inRange(__m128i block, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1)),
+                         _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1)));
+}
+
+// Advances past the first `count` bytes of the block whose newlines are
+// `newlines`.
+static void skipBlockPrefix(int count, unsigned newlines) {
+    scanner.line += __builtin_popcount(newlines & ((1u << count) - 1));
+    scanner.current += count;
+}
+
+static void skipSpaceBlocks() {
+    while (haveBlock()) {
+        __m128i block = loadBlock();
+        unsigned newlines = byteMask(block, '\n');
+        unsigned spaces = byteMask(block, ' ') | byteMask(block, '\t') |
+                          byteMask(block, '\r') | newlines;
+        int count = __builtin_ctz(~spaces);
+        skipBlockPrefix(count, newlines);
+        if (count < BLOCK_SIZE) return;
+    }
+}
+
+static void skipIdentifierBlocks() {
+    while (haveBlock()) {
+        __m128i block = loadBlock();
+        // Setting bit 5 maps upper-case letters to lower-case ones.
+        __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i chars = _mm_or_si128(
+            _mm_or_si128(inRange(lower, 'a', 'z'), inRange(block, '0', '9')),
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+        int count = __builtin_ctz(~(unsigned)_mm_movemask_epi8(chars));
+        scanner.current += count;
+        if (count < BLOCK_SIZE) return;
+    }
+}
+
+static void skipStringBlocks() {
+    while (haveBlock()) {
+        __m128i block = loadBlock();
+        unsigned quotes = byteMask(block, '"');
+        int count = quotes == 0 ? BLOCK_SIZE : __builtin_ctz(quotes);
+        skipBlockPrefix(count, byteMask(block, '\n'));
+        if (count < BLOCK_SIZE) return;
+    }
+}
+
+#else
+
+static void skipSpaceBlocks() {}
+static void skipIdentifierBlocks() {}
+static void skipStringBlocks() {}
+
+#endif
+
 static Token makeToken(TokenType type) {
     Token token;
     token.type = type;
@@ -79,6 +176,7 @@ static Token errorToken(const char* message) {
 
 static void skipWhitespace() {
     for (;;) {
+        skipSpaceBlocks();
         char c = peek();
         switch (c) {
             case ' ':
@@ -92,9 +190,9 @@ static void skipWhitespace() {
                 break;
             case '/':
                 if (peekNext() == '/') {
-                    // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd())
-                        advance();
+                    // A comment goes until the end of the line. strcspn()
+                    // is vectorized already.
+                    scanner.current += strcspn(scanner.current, "\n");
                 } else {
                     return;
                 }
@@ -105,66 +203,70 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
+/**
+ * Keywords are found with a perfect hash of the first two characters and
+ * the length. No two keywords share a slot, so an identifier needs one
+ * lookup and one memcmp() to be classified. The multipliers were found by
+ * trying small ones until every keyword got a slot of its own; if a new
+ * keyword collides, -Woverride-init reports the duplicate slot below and
+ * they have to be searched for again. bench/keywords.c compares this with
+ * the trie it replaced.
+ */
+#define KEYWORD_MIN 2
+#define KEYWORD_MAX 6
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(first, second, length) \
+    (((first) * 7 + (second) * 14 + (length)) & (KEYWORD_SLOTS - 1))
+// The first two characters are repeated because indexing a string literal
+// isn't a constant expression.
+#define KEYWORD(first, second, text, type) \
+    [KEYWORD_HASH(first, second, sizeof(text) - 1)] = \
+        {text, sizeof(text) - 1, type}
 
-    return TOKEN_IDENTIFIER;
-}
+typedef struct {
+    const char* text;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    KEYWORD('a', 'n', "and", TOKEN_AND),
+    KEYWORD('c', 'l', "class", TOKEN_CLASS),
+    KEYWORD('e', 'l', "else", TOKEN_ELSE),
+    KEYWORD('f', 'a', "false", TOKEN_FALSE),
+    KEYWORD('f', 'o', "for", TOKEN_FOR),
+    KEYWORD('f', 'u', "fun", TOKEN_FUN),
+    KEYWORD('i', 'f', "if", TOKEN_IF),
+    KEYWORD('i', 'n', "in", TOKEN_IN),
+    KEYWORD('n', 'i', "nil", TOKEN_NIL),
+    KEYWORD('o', 'r', "or", TOKEN_OR),
+    KEYWORD('p', 'r', "print", TOKEN_PRINT),
+    KEYWORD('r', 'e', "return", TOKEN_RETURN),
+    KEYWORD('s', 'u', "super", TOKEN_SUPER),
+    KEYWORD('t', 'h', "this", TOKEN_THIS),
+    KEYWORD('t', 'r', "true", TOKEN_TRUE),
+    KEYWORD('v', 'a', "var", TOKEN_VAR),
+    KEYWORD('w', 'h', "while", TOKEN_WHILE),
+    KEYWORD('y', 'i', "yield", TOKEN_YIELD),
+};
 
 static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a':
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e':
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a':
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o':
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u':
-                        return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i':
-            return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n':
-            return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o':
-            return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p':
-            return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's':
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h':
-                        return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r':
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v':
-            return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w':
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
+    int length = (int)(scanner.current - scanner.start);
+    if (length < KEYWORD_MIN || length > KEYWORD_MAX) return TOKEN_IDENTIFIER;
 
+    const Keyword* keyword = &keywords[KEYWORD_HASH(
+        (unsigned char)scanner.start[0], (unsigned char)scanner.start[1],
+        length)];
+    // Empty slots have a length of zero, which never matches.
+    if (keyword->length == length &&
+        memcmp(scanner.start, keyword->text, length) == 0) {
+        return keyword->type;
+    }
     return TOKEN_IDENTIFIER;
 }
 
 static Token identifier() {
+    skipIdentifierBlocks();
     // Yes you can write a while loop like this.
     while (isAlpha(peek()) || isDigit(peek()))
         advance();
@@ -188,6 +290,7 @@ static Token number() {
 }
 
 static Token string() {
+    skipStringBlocks();
     while (peek() != '"' && !isAtEnd()) {
         if (peek() == '\n')
             scanner.line++;
@@ -224,12 +327,16 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
-            return makeToken(TOKEN_DOT);
+            return makeToken(match('.') ? TOKEN_DOT_DOT : TOKEN_DOT);
         case '-':
             return makeToken(TOKEN_MINUS);
         case '+':
@@ -243,7 +350,7 @@ Token scanToken() {
         case '=':
             return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_EQUAL);
+            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
             return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         case '"':
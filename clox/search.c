@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "search.h"
+
+/**
+ * Substring search for the string natives. On x86 it compares a whole
+ * vector of candidate positions at once: a position can only match if both
+ * the first and the last byte of the needle are in the right place, and
+ * those two tests take one compare each for 16 (SSE2) or 32 (AVX2)
+ * positions. Only positions that pass both get a memcmp(). AVX2 is picked
+ * at run time if the CPU has it. Elsewhere memchr() finds the candidates.
+ */
+
+#ifdef X86_SIMD
+#include <immintrin.h>
+#endif
+
+static int findScalar(const char* haystack, int length,
+                      const char* needle, int needleLength) {
+    const char* last = haystack + length - needleLength;
+    const char* position = haystack;
+    while (position <= last) {
+        position = memchr(position, needle[0], last - position + 1);
+        if (position == NULL) return -1;
+        if (memcmp(position, needle, needleLength) == 0) {
+            return (int)(position - haystack);
+        }
+        position++;
+    }
+    return -1;
+}
+
+#ifdef X86_SIMD
+
+// Finishes with the scalar search once fewer than a vector of positions
+// is left.
+static int findTail(const char* haystack, int length, int start,
+                    const char* needle, int needleLength) {
+    int found = findScalar(haystack + start, length - start,
+                           needle, needleLength);
+    return found == -1 ? -1 : start + found;
+}
+
+static int findSse2(const char* haystack, int length,
+                    const char* needle, int needleLength) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+
+    int i = 0;
+    for (; i + needleLength - 1 + 16 <= length; i += 16) {
+        __m128i firstBlock = _mm_loadu_si128((const __m128i*)(haystack + i));
+        __m128i lastBlock = _mm_loadu_si128(
+            (const __m128i*)(haystack + i + needleLength - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(first, firstBlock),
+                          _mm_cmpeq_epi8(last, lastBlock)));
+        while (mask != 0) {
+            int offset = __builtin_ctz(mask);
+            if (memcmp(haystack + i + offset, needle, needleLength) == 0) {
+                return i + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findTail(haystack, length, i, needle, needleLength);
+}
+
+__attribute__((target("avx2")))
+static int findAvx2(const char* haystack, int length,
+                    const char* needle, int needleLength) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+
+    int i = 0;
+    for (; i + needleLength - 1 + 32 <= length; i += 32) {
+        __m256i firstBlock = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        __m256i lastBlock = _mm256_loadu_si256(
+            (const __m256i*)(haystack + i + needleLength - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, firstBlock),
+                             _mm256_cmpeq_epi8(last, lastBlock)));
+        while (mask != 0) {
+            int offset = __builtin_ctz(mask);
+            if (memcmp(haystack + i + offset, needle, needleLength) == 0) {
+                return i + offset;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return findTail(haystack, length, i, needle, needleLength);
+}
+
+#endif
+
+// Returns the offset of the first occurrence of `needle`, or -1.
+int findBytes(const char* haystack, int length,
+              const char* needle, int needleLength) {
+    if (needleLength == 0) return 0;
+    if (needleLength > length) return -1;
+
+#ifdef X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return findAvx2(haystack, length, needle, needleLength);
+    }
+    return findSse2(haystack, length, needle, needleLength);
+#else
+    return findScalar(haystack, length, needle, needleLength);
+#endif
+}
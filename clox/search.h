@@ -0,0 +1,9 @@
+#ifndef clox_search_h
+#define clox_search_h
+
+#include "common.h"
+
+int findBytes(const char* haystack, int length,
+              const char* needle, int needleLength);
+
+#endif
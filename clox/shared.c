@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "shared.h"
+#include "vm.h"
+
+/**
+ * The image lives outside every VM's heap, so it is allocated with plain
+ * malloc() instead of reallocate(): it must not count towards any VM's GC
+ * threshold, and no VM's collector may ever free it.
+ */
+static void* allocateShared(size_t size) {
+    void* result = malloc(size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void* copyShared(const void* source, size_t size) {
+    void* result = allocateShared(size);
+    memcpy(result, source, size);
+    return result;
+}
+
+// Maps an opcode the VM may have quickened back to its generic form.
+static uint8_t genericOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_GREATER_NUM:  return OP_GREATER;
+        case OP_LESS_NUM:     return OP_LESS;
+        case OP_ADD_NUM:
+        case OP_ADD_STR:      return OP_ADD;
+        case OP_SUBTRACT_NUM: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM: return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:   return OP_DIVIDE;
+        default:              return instruction;
+    }
+}
+
+/**
+ * A function that has already run may have been quickened. Shared code is
+ * never rewritten, so a specialized instruction in it could never
+ * deoptimize; the copy gets the generic forms back, with fresh counters.
+ */
+static void unquicken(Chunk* chunk, uint8_t* code) {
+    for (int offset = 0;
+         offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t generic = genericOpcode(code[offset]);
+        if (generic != code[offset]) {
+            code[offset] = generic;
+            code[offset + 1] = 0;
+        }
+    }
+}
+
+static SharedFunction* freezeFunction(ObjFunction* function) {
+    SharedFunction* shared = allocateShared(sizeof(SharedFunction));
+    shared->arity = function->arity;
+    shared->upvalueCount = function->upvalueCount;
+    shared->slotCount = function->slotCount;
+    if (function->name == NULL) {
+        shared->name = NULL;
+        shared->nameLength = 0;
+    } else {
+        shared->name = copyShared(function->name->chars, function->name->length);
+        shared->nameLength = function->name->length;
+    }
+
+    Chunk* chunk = &function->chunk;
+    shared->count = chunk->count;
+    shared->code = copyShared(chunk->code, sizeof(uint8_t) * chunk->count);
+    if (chunk->shared == NULL) unquicken(chunk, shared->code);
+    shared->lineCount = chunk->lineCount;
+    shared->lines = copyShared(chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    // The compiler only ever puts numbers, strings and functions in a
+    // constant table.
+    shared->constantCount = chunk->constants.count;
+    shared->constants = allocateShared(sizeof(SharedConstant) * chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        SharedConstant* constant = &shared->constants[i];
+        if (IS_NUMBER(value)) {
+            constant->type = SHARED_NUMBER;
+            constant->as.number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            ObjString* string = AS_STRING(value);
+            constant->type = SHARED_STRING;
+            constant->as.string.length = string->length;
+            constant->as.string.chars = copyShared(string->chars, string->length);
+        } else {
+            constant->type = SHARED_FUNCTION;
+            constant->as.function = freezeFunction(AS_FUNCTION(value));
+        }
+    }
+
+    return shared;
+}
+
+static void freeSharedFunction(SharedFunction* shared) {
+    for (int i = 0; i < shared->constantCount; i++) {
+        SharedConstant* constant = &shared->constants[i];
+        if (constant->type == SHARED_STRING) {
+            free(constant->as.string.chars);
+        } else if (constant->type == SHARED_FUNCTION) {
+            freeSharedFunction(constant->as.function);
+        }
+    }
+
+    free(shared->constants);
+    free(shared->lines);
+    free(shared->code);
+    free(shared->name);
+    free(shared);
+}
+
+/**
+ * Freezes a function that has already been compiled, so that another VM
+ * can load it with loadSharedCode() and call it. The function must not
+ * capture any variables.
+ */
+SharedCode* shareFunction(ObjFunction* function) {
+    SharedCode* code = allocateShared(sizeof(SharedCode));
+    atomic_init(&code->refCount, 1);
+    code->script = freezeFunction(function);
+    return code;
+}
+
+/**
+ * Compiles `source` with the calling thread's VM and freezes the result.
+ * The returned image holds one reference, owned by the caller. Nothing
+ * has been run yet, so none of the code has been quickened.
+ */
+SharedCode* compileShared(const char* source) {
+    ObjFunction* function = compile(source);
+    if (function == NULL) return NULL;
+    return shareFunction(function);
+}
+
+void retainSharedCode(SharedCode* code) {
+    atomic_fetch_add_explicit(&code->refCount, 1, memory_order_relaxed);
+}
+
+void releaseSharedCode(SharedCode* code) {
+    if (atomic_fetch_sub_explicit(&code->refCount, 1,
+                                  memory_order_acq_rel) == 1) {
+        freeSharedFunction(code->script);
+        free(code);
+    }
+}
+
+/**
+ * Builds this VM's ObjFunction for `shared`. The function stays on the VM
+ * stack while its constants are created, since interning them allocates.
+ */
+static ObjFunction* loadFunction(SharedCode* code, SharedFunction* shared) {
+    ensureStack(2); // Nested functions are loaded recursively.
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+
+    function->arity = shared->arity;
+    function->upvalueCount = shared->upvalueCount;
+    function->slotCount = shared->slotCount;
+    if (shared->name != NULL) {
+        function->name = copyString(shared->name, shared->nameLength);
+    }
+
+    retainSharedCode(code);
+    function->chunk.shared = code;
+    function->chunk.code = shared->code;
+    function->chunk.lineCount = shared->lineCount;
+    function->chunk.lineCapacity = shared->lineCount;
+    function->chunk.lines = shared->lines;
+    function->chunk.count = shared->count;
+    function->chunk.capacity = shared->count;
+
+    for (int i = 0; i < shared->constantCount; i++) {
+        SharedConstant* constant = &shared->constants[i];
+        Value value;
+        switch (constant->type) {
+            case SHARED_NUMBER:
+                value = NUMBER_VAL(constant->as.number);
+                break;
+            case SHARED_STRING:
+                value = OBJ_VAL(copyString(constant->as.string.chars,
+                                           constant->as.string.length));
+                break;
+            case SHARED_FUNCTION:
+                value = OBJ_VAL(loadFunction(code, constant->as.function));
+                break;
+        }
+        push(value);
+        writeValueArray(&function->chunk.constants, value);
+        pop();
+    }
+
+    pop();
+    return function;
+}
+
+ObjFunction* loadSharedCode(SharedCode* code) {
+    return loadFunction(code, code->script);
+}
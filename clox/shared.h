@@ -0,0 +1,66 @@
+#ifndef clox_shared_h
+#define clox_shared_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * A compiled script frozen into plain malloc'ed memory that no VM owns.
+ * Any number of VMs, on any threads, can load and run it at once: they
+ * borrow its bytecode and line tables and only build their own constant
+ * tables, interning the strings into their own string table as they go.
+ *
+ * The image is reference counted. Compiling it holds one reference, every
+ * ObjFunction loaded from it holds another, and the memory is freed when
+ * the last one is released.
+ */
+
+typedef struct SharedFunction SharedFunction;
+
+typedef enum {
+    SHARED_NUMBER,
+    SHARED_STRING,
+    SHARED_FUNCTION
+} SharedConstantType;
+
+typedef struct {
+    SharedConstantType type;
+    union {
+        double number;
+        struct {
+            int length;
+            char* chars;
+        } string;
+        SharedFunction* function;
+    } as;
+} SharedConstant;
+
+struct SharedFunction {
+    int arity;
+    int upvalueCount;
+    int slotCount;
+    // NULL for the top level script.
+    char* name;
+    int nameLength;
+    int count;
+    uint8_t* code;
+    int lineCount;
+    LineStart* lines;
+    int constantCount;
+    SharedConstant* constants;
+};
+
+struct SharedCode {
+    atomic_int refCount;
+    SharedFunction* script;
+};
+
+SharedCode* compileShared(const char* source);
+SharedCode* shareFunction(ObjFunction* function);
+void retainSharedCode(SharedCode* code);
+void releaseSharedCode(SharedCode* code);
+ObjFunction* loadSharedCode(SharedCode* code);
+
+#endif
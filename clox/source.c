@@ -0,0 +1,99 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+#define READ_CHUNK 65536
+
+/**
+ * Maps the file with at least one byte to spare after it. Past the end of
+ * the file, the rest of its last page reads as zeros. If the file fills
+ * that page exactly, the spare byte is on the next page, which comes from
+ * an anonymous mapping made first and is zero too. Either way the text is
+ * terminated.
+ */
+static bool mapSource(Source* source, int fd, size_t length) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mappingSize = (length + 1 + pageSize - 1) / pageSize * pageSize;
+
+    void* mapping = mmap(NULL, mappingSize, PROT_READ,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return false;
+    if (mmap(mapping, length, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(mapping, mappingSize);
+        return false;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    source->chars = mapping;
+    source->length = length;
+    source->mapping = mapping;
+    source->mappingSize = mappingSize;
+    return true;
+}
+
+static bool readSource(Source* source, int fd) {
+    size_t capacity = READ_CHUNK;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) return false;
+
+    for (;;) {
+        // Always leave room for the terminator.
+        if (capacity - length < READ_CHUNK + 1) {
+            capacity *= 2;
+            char* grown = realloc(buffer, capacity);
+            if (grown == NULL) {
+                free(buffer);
+                return false;
+            }
+            buffer = grown;
+        }
+
+        ssize_t bytesRead = read(fd, buffer + length, READ_CHUNK);
+        if (bytesRead < 0) {
+            free(buffer);
+            return false;
+        }
+        if (bytesRead == 0) break;
+        length += (size_t)bytesRead;
+    }
+
+    buffer[length] = '\0';
+    source->chars = buffer;
+    source->length = length;
+    source->buffer = buffer;
+    return true;
+}
+
+// Returns false if the file can't be opened or read.
+bool openSource(Source* source, const char* path) {
+    memset(source, 0, sizeof(Source));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat status;
+    bool opened;
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+        status.st_size > 0) {
+        opened = mapSource(source, fd, (size_t)status.st_size);
+    } else {
+        opened = readSource(source, fd);
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    return opened;
+}
+
+void closeSource(Source* source) {
+    if (source->mapping != NULL) munmap(source->mapping, source->mappingSize);
+    free(source->buffer);
+    memset(source, 0, sizeof(Source));
+}
@@ -0,0 +1,32 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include <stddef.h>
+
+#include "common.h"
+
+/**
+ * The text of a script file, NUL-terminated for the scanner.
+ *
+ * A regular file is mapped rather than read. Its pages are loaded as the
+ * scanner reaches them, with read-ahead in the background, so compiling
+ * overlaps with the I/O. They are clean page cache, which the kernel can
+ * drop again once the scanner has passed them, so even a huge generated
+ * script doesn't need a buffer of its own size. All of the file is mapped
+ * at once, so a token's lexeme can never be split across two pieces.
+ *
+ * Anything else, like a pipe, is read into a buffer.
+ */
+typedef struct {
+    const char* chars;
+    size_t length;
+    // Set for a mapped file; `buffer` is set for one that was read.
+    void* mapping;
+    size_t mappingSize;
+    char* buffer;
+} Source;
+
+bool openSource(Source* source, const char* path);
+void closeSource(Source* source);
+
+#endif
@@ -0,0 +1,218 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define CYCLE_COUNTER
+#endif
+
+#include "chunk.h"
+#include "native.h"
+#include "object.h"
+#include "table.h"
+#include "timer.h"
+#include "vm.h"
+
+/**
+ * The counter is calibrated once per process; every thread reads the same
+ * one, so workers share the result.
+ */
+typedef struct {
+    bool invariant; // Whether the cycle counter can be used at all.
+    double nanosPerTick;
+    uint64_t startTicks;
+    uint64_t startNanos;
+} CycleCounter;
+
+static CycleCounter counter;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+
+uint64_t monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+#ifdef CYCLE_COUNTER
+static uint64_t readTicks() {
+    // Keeps the read from being moved ahead of the code being timed.
+    _mm_lfence();
+    return __rdtsc();
+}
+#endif
+
+/**
+ * Counts ticks of the cycle counter against CLOCK_MONOTONIC for
+ * TIMER_CALIBRATION_NS. Without an invariant TSC the rate changes with
+ * the CPU's frequency, so the counter is not used.
+ */
+static void calibrate() {
+    counter.invariant = false;
+    counter.startNanos = monotonicNanos();
+#ifdef CYCLE_COUNTER
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return;
+    if (!(edx & (1 << 8))) return;
+
+    uint64_t startTicks = readTicks();
+    uint64_t startNanos = monotonicNanos();
+    uint64_t nanos;
+    do {
+        nanos = monotonicNanos() - startNanos;
+    } while (nanos < TIMER_CALIBRATION_NS);
+    uint64_t ticks = readTicks() - startTicks;
+
+    counter.nanosPerTick = (double)nanos / (double)ticks;
+    counter.startTicks = startTicks;
+    counter.invariant = true;
+#endif
+}
+
+/**
+ * Nanoseconds since the first call in the process, from the cycle counter
+ * when it can be used.
+ */
+double cycleNanos() {
+    pthread_once(&calibrated, calibrate);
+#ifdef CYCLE_COUNTER
+    if (counter.invariant) {
+        return (double)(readTicks() - counter.startTicks) * counter.nanosPerTick;
+    }
+#endif
+    return (double)(monotonicNanos() - counter.startNanos);
+}
+
+Value clockNative(int argCount, Value* args) {
+    (void)argCount;
+    (void)args;
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+Value nanoTimeNative(int argCount, Value* args) {
+    (void)argCount;
+    (void)args;
+    return NUMBER_VAL((double)monotonicNanos());
+}
+
+Value nowNative(int argCount, Value* args) {
+    (void)argCount;
+    (void)args;
+    return NUMBER_VAL(cycleNanos());
+}
+
+/**
+ * Times `iterations` calls of `fn` in `sampleCount` batches and stores the
+ * nanoseconds per call of each batch in `samples`.
+ */
+static bool timeBatches(Value fn, long iterations, int sampleCount,
+                        double* samples) {
+    Value result;
+    for (int i = 0; i < sampleCount; i++) {
+        long calls = iterations / sampleCount + (i < iterations % sampleCount);
+        double start = cycleNanos();
+        for (long call = 0; call < calls; call++) {
+            if (!nativeCall(fn, 0, NULL, &result)) return false;
+        }
+        samples[i] = (cycleNanos() - start) / calls;
+    }
+    return true;
+}
+
+static int compareSamples(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double* samples, int count) {
+    qsort(samples, count, sizeof(double), compareSamples);
+    if (count % 2 == 1) return samples[count / 2];
+    return (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+/**
+ * A function that returns nil straight away, to measure what calling
+ * through nativeCall() costs on its own.
+ */
+static ObjClosure* newEmptyClosure() {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    writeChunk(&function->chunk, OP_NIL, 0);
+    writeChunk(&function->chunk, OP_RETURN, 0);
+    function->slotCount = 2; // Itself and the nil.
+    ObjClosure* closure = newClosure(function);
+    pop();
+    return closure;
+}
+
+static void setField(ObjInstance* instance, const char* name, double value) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    tableSet(&instance->fields, AS_STRING(vm.stackTop[-1]), NUMBER_VAL(value));
+    pop();
+}
+
+Value benchNative(int argCount, Value* args) {
+    (void)argCount;
+    double count = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : 0;
+    if (count < 1 || count > LONG_MAX || count != floor(count)) {
+        return nativeError("bench() takes a function and a positive whole "
+                           "number of iterations.");
+    }
+    // Copied out now: the calls can move the stack under `args`.
+    Value fn = args[0];
+    long iterations = (long)count;
+    int sampleCount = iterations < BENCH_SAMPLES ? (int)iterations
+                                                 : BENCH_SAMPLES;
+
+    Value result;
+    long warmup = iterations / BENCH_WARMUP_DIVISOR;
+    if (warmup < 1) warmup = 1;
+    for (long call = 0; call < warmup; call++) {
+        if (!nativeCall(fn, 0, NULL, &result)) return NIL_VAL;
+    }
+
+    push(OBJ_VAL(newEmptyClosure()));
+    double overheads[BENCH_SAMPLES];
+    if (!timeBatches(vm.stackTop[-1], iterations, sampleCount, overheads)) {
+        return NIL_VAL;
+    }
+    pop();
+    double overhead = median(overheads, sampleCount);
+
+    double samples[BENCH_SAMPLES];
+    if (!timeBatches(fn, iterations, sampleCount, samples)) return NIL_VAL;
+
+    double sum = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        samples[i] = samples[i] > overhead ? samples[i] - overhead : 0;
+        sum += samples[i];
+    }
+    double mean = sum / sampleCount;
+    double squares = 0;
+    for (int i = 0; i < sampleCount; i++) {
+        squares += (samples[i] - mean) * (samples[i] - mean);
+    }
+    double stddev = sampleCount > 1 ? sqrt(squares / (sampleCount - 1)) : 0;
+    double middle = median(samples, sampleCount);
+
+    push(OBJ_VAL(copyString("Bench", 5)));
+    ObjClass* klass = newClass(AS_STRING(vm.stackTop[-1]));
+    push(OBJ_VAL(klass));
+    ObjInstance* instance = newInstance(klass);
+    push(OBJ_VAL(instance));
+    setField(instance, "iterations", (double)iterations);
+    setField(instance, "min", samples[0]);
+    setField(instance, "median", middle);
+    setField(instance, "mean", mean);
+    setField(instance, "stddev", stddev);
+    setField(instance, "overhead", overhead);
+    pop();
+    pop();
+    pop();
+    return OBJ_VAL(instance);
+}
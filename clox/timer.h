@@ -0,0 +1,42 @@
+#ifndef clox_timer_h
+#define clox_timer_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/**
+ * Clocks for timing code from a script.
+ *
+ * clock() is the CPU time of the process in seconds. It stops while the
+ * process is blocked and is too coarse for anything short. nanoTime() is
+ * CLOCK_MONOTONIC in nanoseconds: wall time that never jumps and can be
+ * compared across threads. now() also returns nanoseconds, read from the
+ * CPU's cycle counter where that ticks at a constant rate (an invariant
+ * TSC on x86-64) and from CLOCK_MONOTONIC elsewhere. It is the cheapest
+ * clock to read, so it is the one for microbenchmarks. The first call
+ * calibrates the counter, which takes TIMER_CALIBRATION_NS.
+ *
+ * bench(fn, iterations) calls fn() that many times from C, after a warmup
+ * of a tenth as many calls, so no Lox loop is part of what is measured.
+ * The calls are timed in BENCH_SAMPLES batches with now(). Calling an
+ * empty function the same way is timed too and taken off every batch.
+ * It returns an instance with the nanoseconds per call: `min`, `median`,
+ * `mean` and `stddev` across the batches, the `overhead` that was taken
+ * off, and the number of `iterations`.
+ */
+
+#define TIMER_CALIBRATION_NS 10000000
+#define BENCH_SAMPLES 20
+#define BENCH_WARMUP_DIVISOR 10
+
+uint64_t monotonicNanos();
+double cycleNanos();
+
+Value clockNative(int argCount, Value* args);
+Value nanoTimeNative(int argCount, Value* args);
+Value nowNative(int argCount, Value* args);
+Value benchNative(int argCount, Value* args);
+
+#endif
@@ -0,0 +1,136 @@
+/**
+ * Prints a trace written with `clox --trace-file` as text, one instruction
+ * per line: call depth, values on the stack, function and offset, and
+ * opcode. With --summary, prints how often each function and opcode ran
+ * instead.
+ *
+ * Build with `make decode-trace`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+typedef struct {
+    char* name;
+    uint64_t count;
+} Named;
+
+typedef struct {
+    Named* items;
+    int count;
+    int capacity;
+} NamedArray;
+
+static void fail(const char* message) {
+    fprintf(stderr, "decode-trace: %s\n", message);
+    exit(65);
+}
+
+static void readExactly(FILE* file, void* bytes, size_t length) {
+    if (fread(bytes, 1, length, file) != length) fail("truncated trace.");
+}
+
+static char* readName(FILE* file, size_t length) {
+    char* name = malloc(length + 1);
+    if (name == NULL) exit(1);
+    readExactly(file, name, length);
+    name[length] = '\0';
+    return name;
+}
+
+// Ids are handed out in order, so a function's id is its index plus one.
+static void addFunction(NamedArray* functions, uint32_t id, char* name) {
+    if (id != (uint32_t)functions->count + 1) fail("function ids out of order.");
+    if (functions->count == functions->capacity) {
+        functions->capacity = functions->capacity < 8 ? 8 : functions->capacity * 2;
+        functions->items = realloc(functions->items,
+                                   sizeof(Named) * functions->capacity);
+        if (functions->items == NULL) exit(1);
+    }
+    functions->items[functions->count].name = name;
+    functions->items[functions->count].count = 0;
+    functions->count++;
+}
+
+static int compareCounts(const void* a, const void* b) {
+    uint64_t x = ((const Named*)a)->count;
+    uint64_t y = ((const Named*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void printCounts(const char* title, NamedArray* array, uint64_t total) {
+    qsort(array->items, array->count, sizeof(Named), compareCounts);
+    printf("%-24s %14s %7s\n", title, "count", "share");
+    for (int i = 0; i < array->count; i++) {
+        Named* item = &array->items[i];
+        if (item->count == 0) break;
+        printf("%-24s %14llu %6.2f%%\n", item->name,
+               (unsigned long long)item->count, 100.0 * item->count / total);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    bool summary = argc == 3 && strcmp(argv[1], "--summary") == 0;
+    if (argc != 2 && !summary) {
+        fprintf(stderr, "Usage: decode-trace [--summary] trace\n");
+        exit(64);
+    }
+
+    FILE* file = fopen(argv[argc - 1], "rb");
+    if (file == NULL) fail("could not open trace.");
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    readExactly(file, magic, sizeof(magic));
+    if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) fail("not a clox trace.");
+
+    uint32_t opcodeCount;
+    readExactly(file, &opcodeCount, sizeof(opcodeCount));
+    if (opcodeCount > UINT8_COUNT) fail("corrupt opcode table.");
+    NamedArray opcodes = {calloc(opcodeCount, sizeof(Named)), opcodeCount,
+                          opcodeCount};
+    for (uint32_t i = 0; i < opcodeCount; i++) {
+        uint8_t length;
+        readExactly(file, &length, 1);
+        opcodes.items[i].name = readName(file, length);
+    }
+
+    NamedArray functions = {NULL, 0, 0};
+    uint64_t total = 0;
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.kind == TRACE_FUNCTION) {
+            addFunction(&functions, record.function,
+                        readName(file, record.offset));
+            continue;
+        }
+
+        if (record.kind != TRACE_INSTRUCTION ||
+            record.function == 0 || record.function > (uint32_t)functions.count ||
+            record.opcode >= opcodeCount) {
+            fail("corrupt record.");
+        }
+
+        total++;
+        Named* function = &functions.items[record.function - 1];
+        Named* opcode = &opcodes.items[record.opcode];
+        if (summary) {
+            function->count++;
+            opcode->count++;
+        } else {
+            printf("%5u %6u  %s+%04u  %s\n", record.frames, record.stack,
+                   function->name, record.offset, opcode->name);
+        }
+    }
+    fclose(file);
+
+    if (summary) {
+        printf("%llu instructions\n\n", (unsigned long long)total);
+        printCounts("function", &functions, total);
+        printf("\n");
+        printCounts("opcode", &opcodes, total);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    FILE* file;
+    uint8_t* buffer;
+    size_t used;
+    uint32_t nextFunction;
+} Tracer;
+
+static THREAD_LOCAL Tracer tracer;
+
+static void flushTrace() {
+    fwrite(tracer.buffer, 1, tracer.used, tracer.file);
+    tracer.used = 0;
+}
+
+static void writeTrace(const void* bytes, size_t length) {
+    if (tracer.used + length > TRACE_BUFFER_SIZE) flushTrace();
+    if (length > TRACE_BUFFER_SIZE) {
+        fwrite(bytes, 1, length, tracer.file);
+        return;
+    }
+
+    memcpy(tracer.buffer + tracer.used, bytes, length);
+    tracer.used += length;
+}
+
+/**
+ * Starts tracing the calling thread's VM to the file at `path`, replacing
+ * it. Returns false if it can't be created.
+ */
+bool openTrace(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+
+    closeTrace();
+    tracer.file = file;
+    tracer.buffer = malloc(TRACE_BUFFER_SIZE);
+    if (tracer.buffer == NULL) exit(1);
+    tracer.used = 0;
+    tracer.nextFunction = 1;
+
+    writeTrace(TRACE_MAGIC, strlen(TRACE_MAGIC));
+    uint32_t opcodeCount = OPCODE_COUNT;
+    writeTrace(&opcodeCount, sizeof(opcodeCount));
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        const char* name = opcodeName(i);
+        uint8_t length = (uint8_t)strlen(name);
+        writeTrace(&length, 1);
+        writeTrace(name, length);
+    }
+    return true;
+}
+
+void closeTrace() {
+    if (tracer.file == NULL) return;
+
+    flushTrace();
+    fclose(tracer.file);
+    free(tracer.buffer);
+    tracer.file = NULL;
+    tracer.buffer = NULL;
+}
+
+bool tracing() {
+    return tracer.file != NULL;
+}
+
+static void introduceFunction(ObjFunction* function) {
+    function->traceId = tracer.nextFunction++;
+
+    const char* name = "script";
+    int length = 6;
+    if (function->name != NULL) {
+        name = function->name->chars;
+        length = function->name->length;
+    }
+
+    TraceRecord record = {
+        .kind = TRACE_FUNCTION,
+        .function = function->traceId,
+        .offset = (uint32_t)length,
+    };
+    writeTrace(&record, sizeof(record));
+    writeTrace(name, length);
+}
+
+void traceInstruction(ObjFunction* function, int offset, int frames,
+                      int stack) {
+    if (function->traceId == 0) introduceFunction(function);
+
+    TraceRecord record = {
+        .kind = TRACE_INSTRUCTION,
+        .opcode = function->chunk.code[offset],
+        .frames = frames > UINT16_MAX ? UINT16_MAX : (uint16_t)frames,
+        .function = function->traceId,
+        .offset = (uint32_t)offset,
+        .stack = (uint32_t)stack,
+    };
+    writeTrace(&record, sizeof(record));
+}
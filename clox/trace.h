@@ -0,0 +1,52 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * Execution tracing for any build. When a trace file is open, run()
+ * switches to a second copy of its dispatch loop that records every
+ * instruction before executing it; otherwise that copy is never entered
+ * and the loop pays nothing for tracing. The profiler in profile.h uses
+ * the same copy. Turn it on with --trace-file or
+ * the CLOX_TRACE environment variable. Only the thread that opened the
+ * trace is traced, so workers run untraced.
+ *
+ * Records are written through a buffer, so they reach the file in large
+ * writes. Decode a trace with tools/decode-trace.c (make decode-trace).
+ *
+ * The file starts with TRACE_MAGIC and the opcode names, one length byte
+ * and the characters each, so that the decoder doesn't depend on the
+ * opcode numbering of the binary that wrote it. TraceRecords follow, in
+ * the byte order of the machine. The first time a function appears, a
+ * TRACE_FUNCTION record introduces its id, with the length of its name in
+ * `offset` and the name itself right after the record.
+ */
+
+#define TRACE_MAGIC "CLOXTRC1"
+#define TRACE_ENV "CLOX_TRACE"
+
+typedef enum {
+    TRACE_INSTRUCTION,
+    TRACE_FUNCTION
+} TraceKind;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t opcode;
+    uint16_t frames;   // Call depth, saturating.
+    uint32_t function; // Id introduced by an earlier TRACE_FUNCTION.
+    uint32_t offset;   // Of the instruction in the function's chunk.
+    uint32_t stack;    // Values on the VM stack.
+} TraceRecord;
+
+bool openTrace(const char* path);
+void closeTrace();
+bool tracing();
+void traceInstruction(ObjFunction* function, int offset, int frames,
+                      int stack);
+
+#endif
@@ -1,25 +1,159 @@
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "io.h"
+#include "library.h"
 #include "object.h"
 #include "memory.h"
+#include "native.h"
+#include "profile.h"
+#include "shared.h"
+#include "timer.h"
+#include "trace.h"
 #include "vm.h"
+#include "worker.h"
 
-VM vm;
+THREAD_LOCAL VM vm;
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+#define TRACE_FRAMES_SHOWN 16
+
+static Value fiberNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        return nativeError("Fiber() takes a function with at most one parameter.");
+    }
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+}
+
+static Value isDoneNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_FIBER(args[0])) return nativeError("isDone() takes a fiber.");
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+/**
+ * Makes sure there are at least `needed` free slots above vm.stackTop.
+ * Moving the stack leaves every pointer into it dangling, so the frame
+ * windows, the open upvalues and stackTop are all rebased onto the new
+ * block. Callers must reload any Value* they held across this call.
+ */
+void ensureStack(int needed) {
+    int used = (int)(vm.stackTop - vm.stack);
+    if (used + needed <= vm.stackCapacity) return;
+
+    int capacity = vm.stackCapacity;
+    while (capacity < used + needed) capacity *= 2;
+
+    // Copy rather than realloc() so the old block stays valid while every
+    // pointer into it is rebased.
+    Value* oldStack = vm.stack;
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, oldStack, sizeof(Value) * used);
+
+    if (vm.openUpvalues != NULL) {
+        ObjUpvalue** open = (ObjUpvalue**)realloc(vm.openUpvalues,
+                                                  sizeof(ObjUpvalue*) * capacity);
+        if (open == NULL) exit(1);
+        memset(open + vm.stackCapacity, 0,
+               sizeof(ObjUpvalue*) * (capacity - vm.stackCapacity));
+        vm.openUpvalues = open;
+    }
+
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    vm.stackTop = stack + used;
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - oldStack);
+    }
+    for (int i = 0; i < vm.openUpvalueTop; i++) {
+        if (vm.openUpvalues[i] != NULL) vm.openUpvalues[i]->location = stack + i;
+    }
+
+    free(oldStack);
+}
+
+/**
+ * Makes room for a frame running `function`. The compiler worked out how
+ * many slots it can use at most, so nothing run() pushes has to check.
+ */
+static void reserveFrame(ObjFunction* function) {
+    ensureStack(function->slotCount + STACK_SLACK);
 }
 
+/**
+ * Brackets every change of vm.frames itself, so that the sampling
+ * profiler's signal handler never follows a pointer to an array that has
+ * been freed or belongs to another fiber. The fences only keep the
+ * compiler from moving the stores across them.
+ */
+static void beginFrameChange() {
+    vm.framesChanging = true;
+    atomic_signal_fence(memory_order_seq_cst);
+}
+
+static void endFrameChange() {
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.framesChanging = false;
+}
+
+static void saveFiber(ObjFiber* fiber) {
+    fiber->frames = vm.frames;
+    fiber->frameCount = vm.frameCount;
+    fiber->frameCapacity = vm.frameCapacity;
+    fiber->stack = vm.stack;
+    fiber->stackTop = vm.stackTop;
+    fiber->stackCapacity = vm.stackCapacity;
+    fiber->openUpvalues = vm.openUpvalues;
+    fiber->openUpvalueTop = vm.openUpvalueTop;
+}
+
+static void loadFiber(ObjFiber* fiber) {
+    beginFrameChange();
+    vm.fiber = fiber;
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    vm.frameCapacity = fiber->frameCapacity;
+    endFrameChange();
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.stackCapacity = fiber->stackCapacity;
+    vm.openUpvalues = fiber->openUpvalues;
+    vm.openUpvalueTop = fiber->openUpvalueTop;
+}
+
+static void switchFiber(ObjFiber* fiber) {
+    saveFiber(vm.fiber);
+    loadFiber(fiber);
+}
+
+/**
+ * Abandons everything that is running. An error inside a fiber also ends
+ * every fiber that was waiting on it, and every task on the event loop.
+ */
 static void resetStack() {
+    ObjFiber* fiber = vm.fiber;
+    while (fiber != NULL) {
+        ObjFiber* caller = fiber->caller;
+        if (fiber != vm.mainFiber) fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber = caller;
+    }
+    ioReset();
+    if (vm.fiber != vm.mainFiber) switchFiber(vm.mainFiber);
+
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    if (vm.openUpvalues != NULL) {
+        memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * vm.openUpvalueTop);
+    }
+    vm.openUpvalueTop = 0;
 }
 
 static void runtimeError(const char* format, ...) {
@@ -30,11 +164,19 @@ static void runtimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep recursion would bury the error under thousands of identical
+        // lines, so only the innermost and outermost frames are shown.
+        if (i == vm.frameCount - 1 - TRACE_FRAMES_SHOWN && i >= TRACE_FRAMES_SHOWN) {
+            fprintf(stderr, "... %d more frames ...\n", i - TRACE_FRAMES_SHOWN + 1);
+            i = TRACE_FRAMES_SHOWN - 1;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
+        // The native that made the call shows up in the frame below.
+        if (frame->closure == vm.nativeCall) continue;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ",
-            function->chunk.lines[instruction]);
+            getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -45,16 +187,25 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
-}
-
 void initVM() {
-  resetStack();
+  vm.fiber = NULL;
+  vm.mainFiber = NULL;
+  vm.fibers = NULL;
+  vm.frames = NULL;
+  vm.frameCount = 0;
+  vm.framesChanging = false;
+  vm.stack = NULL;
+  vm.stackTop = NULL;
+  vm.openUpvalues = NULL;
+  vm.openUpvalueTop = 0;
+  vm.framesMax = FRAMES_MAX;
+#ifdef INSTRUMENT_OPCODES
+  memset(vm.opcodeCounts, 0, sizeof(vm.opcodeCounts));
+#endif
+  vm.native = NULL;
+  vm.nativeFailed = false;
+  vm.nativeCallFailed = false;
+  vm.nativeCall = NULL;
   vm.objects = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
@@ -65,20 +216,100 @@ void initVM() {
 
   initTable(&vm.globals);
   initTable(&vm.strings);
+  vm.globalsImage = NULL;
+  vm.globalsImageId = 0;
+  vm.globalsChanged = true;
+
+  initLoop(&vm.loop);
+  vm.mainFiber = newFiber(NULL);
+  loadFiber(vm.mainFiber);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  ObjFunction* exitFunction = newFunction();
+  push(OBJ_VAL(exitFunction));
+  writeChunk(&exitFunction->chunk, OP_EXIT, 0);
+  exitFunction->slotCount = 2; // Itself and the result.
+  exitFunction->name = copyString("native", 6);
+  vm.nativeCall = newClosure(exitFunction);
+  pop();
+
+  defineNative("clock", clockNative, 0, NULL);
+  defineNative("nanoTime", nanoTimeNative, 0, NULL);
+  defineNative("now", nowNative, 0, NULL);
+  defineNative("bench", benchNative, 2, NULL);
+  defineNative("Fiber", fiberNative, 1, NULL);
+  defineNative("isDone", isDoneNative, 1, NULL);
+  defineNative("schedule", scheduleNative, NATIVE_VARIADIC, NULL);
+  defineNative("sleep", sleepNative, 1, NULL);
+  defineNative("readFile", readFileNative, 1, NULL);
+  defineNative("writeFile", writeFileNative, 2, NULL);
+  defineNative("listen", listenNative, 2, NULL);
+  defineNative("listenUnix", listenUnixNative, 1, NULL);
+  defineNative("accept", acceptNative, 1, NULL);
+  defineNative("connect", connectNative, 2, NULL);
+  defineNative("connectUnix", connectUnixNative, 1, NULL);
+  defineNative("read", readNative, 1, NULL);
+  defineNative("write", writeNative, 2, NULL);
+  defineNative("close", closeNative, 1, NULL);
+  defineNative("spawn", spawnNative, NATIVE_VARIADIC, NULL);
+  defineNative("join", joinNative, 1, NULL);
+  defineNative("Channel", channelNative, 0, NULL);
+  defineNative("send", sendNative, 2, NULL);
+  defineNative("receive", receiveNative, 1, NULL);
+  defineLibrary();
 }
 
 void freeVM() {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    if (vm.globalsImage != NULL) releaseGlobalsImage(vm.globalsImage);
+    vm.globalsImage = NULL;
     vm.initString = NULL;
+    vm.nativeCall = NULL;
+    // Hand the running stacks back to their fiber so they are freed with it.
+    saveFiber(vm.fiber);
+    beginFrameChange();
+    vm.frames = NULL;
+    vm.frameCount = 0;
+    endFrameChange();
+    freeLoop(&vm.loop);
     freeObjects();
 }
 
+#ifdef INSTRUMENT_OPCODES
+/**
+ * Prints the opcodes this VM has dispatched to stderr, most frequent first.
+ * Quickened and fused forms are counted under their own names.
+ */
+void printOpcodeCounts() {
+    uint64_t total = 0;
+    int order[OPCODE_COUNT];
+    int count = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        total += vm.opcodeCounts[i];
+        if (vm.opcodeCounts[i] == 0) continue;
+
+        // Insertion sort: there are fewer than a hundred opcodes.
+        int j = count++;
+        while (j > 0 && vm.opcodeCounts[order[j - 1]] < vm.opcodeCounts[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    fprintf(stderr, "%-20s %14s %7s\n", "opcode", "count", "share");
+    for (int i = 0; i < count; i++) {
+        uint64_t executed = vm.opcodeCounts[order[i]];
+        fprintf(stderr, "%-20s %14llu %6.2f%%\n", opcodeName(order[i]),
+                (unsigned long long)executed, 100.0 * executed / total);
+    }
+    fprintf(stderr, "%-20s %14llu\n", "total", (unsigned long long)total);
+}
+#endif
+
 void push(Value value) {
     *vm.stackTop = value;
     vm.stackTop++;
@@ -99,15 +330,144 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.framesMax) {
         runtimeError("Stack overflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    if (vm.frameCount == vm.frameCapacity) {
+        beginFrameChange();
+        vm.frameCapacity = GROW_CAPACITY(vm.frameCapacity);
+        if (vm.frameCapacity > vm.framesMax) vm.frameCapacity = vm.framesMax;
+        vm.frames = (CallFrame*)realloc(vm.frames,
+                                        sizeof(CallFrame) * vm.frameCapacity);
+        if (vm.frames == NULL) exit(1);
+        endFrameChange();
+    }
+
+    reserveFrame(closure->function);
+
+    // Filled in before it is counted, for the sampling profiler.
+    CallFrame* frame = &vm.frames[vm.frameCount];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.frameCount++;
+    return true;
+}
+
+/**
+ * Switches to `fiber`, passing it the argument (if any). The callee and the
+ * argument are popped from the caller's stack now; whatever the fiber yields
+ * or returns is pushed there when control comes back.
+ */
+static bool resumeFiber(ObjFiber* fiber, int argCount) {
+    if (argCount > 1) {
+        runtimeError("Expected 0 or 1 arguments but got %d.", argCount);
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtimeError("Can't resume a finished fiber.");
+        return false;
+    }
+    if (fiber->state == FIBER_RUNNING) {
+        runtimeError("Can't resume a fiber that is already running.");
+        return false;
+    }
+
+    Value value = argCount == 1 ? peek(0) : NIL_VAL;
+    vm.stackTop -= argCount + 1;
+
+    fiber->caller = vm.fiber;
+    switchFiber(fiber);
+    if (fiber->state == FIBER_SUSPENDED) {
+        push(value); // The result of the `yield`.
+    } else if (vm.frames[0].closure->function->arity == 1) {
+        push(value); // The function's parameter.
+    }
+    fiber->state = FIBER_RUNNING;
+    return true;
+}
+
+/**
+ * Gives control back to whoever resumed the running fiber, handing them
+ * `value`. When `done` is set the fiber has returned and can't be resumed.
+ */
+static void leaveFiber(Value value, bool done) {
+    ObjFiber* fiber = vm.fiber;
+    ObjFiber* caller = fiber->caller;
+    fiber->state = done ? FIBER_DONE : FIBER_SUSPENDED;
+    fiber->caller = NULL;
+    switchFiber(caller);
+    push(value);
+}
+
+/**
+ * Parks the running fiber until the descriptor a native asked for with
+ * ioBlock() is ready, and runs another fiber meanwhile. The native's result
+ * is already on the stack as a placeholder that the event loop replaces.
+ */
+static bool waitForIo() {
+    int fd = vm.loop.blockFd;
+    if (vm.fiber->nativeCalls > 0) {
+        vm.loop.blocked = false;
+        runtimeError("Can't wait for I/O inside a call made by a native.");
+        return false;
+    }
+    if (!ioPark(vm.fiber)) {
+        runtimeError("Can't wait on descriptor %d.", fd);
+        return false;
+    }
+
+    saveFiber(vm.fiber);
+    ObjFiber* next = ioNextFiber();
+    if (next == NULL) {
+        runtimeError("Event loop failed.");
+        return false;
+    }
+    loadFiber(next);
+    return true;
+}
+
+/**
+ * Called when a fiber nobody resumed runs out of code: the script itself or
+ * a scheduled task. Switches to the next fiber the event loop has ready.
+ * Once nothing is left to run it returns false, back on the main fiber.
+ */
+static bool runNextTask() {
+    saveFiber(vm.fiber);
+    ObjFiber* next = ioNextFiber();
+    loadFiber(next != NULL ? next : vm.mainFiber);
+    return next != NULL;
+}
+
+/**
+ * Natives get their arguments in place on the stack, and the result then
+ * replaces the callee and the arguments. See native.h.
+ */
+static bool callNative(ObjNative* native, int argCount) {
+    if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d", native->arity, argCount);
+        return false;
+    }
+
+    vm.native = native;
+    Value result = native->function(argCount, vm.stackTop - argCount);
+    vm.native = NULL;
+    if (vm.nativeFailed) {
+        vm.nativeFailed = false;
+        if (vm.nativeCallFailed) {
+            vm.nativeCallFailed = false;
+        } else {
+            runtimeError("%s", vm.nativeMessage);
+        }
+        return false;
+    }
+
+    vm.stackTop -= argCount + 1;
+    push(result);
+    if (vm.loop.blocked) return waitForIo();
     return true;
 }
 
@@ -129,19 +489,16 @@ static bool callValue(Value callee, int argCount) {
         } else if (argCount != 0) {
           runtimeError("Expected 0 arguments but got %d.",
                          argCount);
-          return false
+          return false;
         }
         return true;
       }
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
-        return true;
-      }
+      case OBJ_FIBER:
+        return resumeFiber(AS_FIBER(callee), argCount);
+      case OBJ_NATIVE:
+        return callNative(AS_NATIVE(callee), argCount);
       default:
         break; // Non-callable object type.
     }
@@ -194,37 +551,71 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
 }
 
 static ObjUpvalue* captureUpvalue(Value* local) {
-    ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    if (vm.openUpvalues == NULL) {
+        vm.openUpvalues = (ObjUpvalue**)calloc(vm.stackCapacity,
+                                               sizeof(ObjUpvalue*));
+        if (vm.openUpvalues == NULL) exit(1);
     }
 
-    ObjUpvalue* createdUpvalue = newUpValue(local);
-    createdUpvalue->next = upvalue;
+    int slot = (int)(local - vm.stack);
+    if (vm.openUpvalues[slot] != NULL) return vm.openUpvalues[slot];
 
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = createdUpvalue;
-    }
-
-    return createdUpvalue;
+    ObjUpvalue* upvalue = newUpValue(local);
+    vm.openUpvalues[slot] = upvalue;
+    if (slot >= vm.openUpvalueTop) vm.openUpvalueTop = slot + 1;
+    return upvalue;
 }
 
+/**
+ * Closes the upvalues of every slot from `last` up. Returning from a
+ * function whose variables were never captured costs one comparison.
+ */
 static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL &&
-        vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    int first = (int)(last - vm.stack);
+    for (int slot = vm.openUpvalueTop - 1; slot >= first; slot--) {
+        ObjUpvalue* upvalue = vm.openUpvalues[slot];
+        if (upvalue == NULL) continue;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm.openUpvalues[slot] = NULL;
     }
+    if (vm.openUpvalueTop > first) vm.openUpvalueTop = first;
+}
+
+/**
+ * Calls `callee` in place of the function running in the current frame.
+ * Closures and bound methods reuse the frame: its upvalues are closed, the
+ * callee and its arguments slide down over frame->slots and the frame
+ * starts over in the new function, so tail recursion runs in constant
+ * stack space. Anything else is called normally and the OP_RETURN that
+ * follows every OP_TAIL_CALL returns its result.
+ */
+static bool tailCallValue(Value callee, int argCount) {
+  ObjClosure* closure;
+  if (IS_CLOSURE(callee)) {
+    closure = AS_CLOSURE(callee);
+  } else if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    closure = bound->method;
+  } else {
+    return callValue(callee, argCount);
+  }
+
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d", closure->function->arity, argCount);
+    return false;
+  }
+
+  reserveFrame(closure->function);
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
 }
 
 static void defineMethod(ObjString* name) {
@@ -238,9 +629,31 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+/**
+ * Checks that `index` is a whole number addressing an existing item and
+ * stores it in `slot`. Reports a runtime error otherwise.
+ */
+static bool listIndex(ObjList* list, Value index, int* slot) {
+  if (!IS_NUMBER(index)) {
+    runtimeError("List index must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(index);
+  // In range first: converting NaN or a huge number to int is undefined.
+  if (!(number >= 0 && number < list->items.count) ||
+      number != (int)number) {
+    runtimeError("List index out of range.");
+    return false;
+  }
+
+  *slot = (int)number;
+  return true;
+}
+
 static void concatenate() {
-  ObjString* b = AS_STRING(pop(0));
-  ObjString* a = AS_STRING(pop(1));
+  ObjString* b = AS_STRING(peek(0));
+  ObjString* a = AS_STRING(peek(1));
 
   int length = a->length + b->length;
   char* chars = ALLOCATE(char, length + 1);
@@ -254,7 +667,12 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+/**
+ * The dispatch loop. run() calls it with a constant `observed`, so it is
+ * inlined as two loops. The observed one reports each instruction to the
+ * tracer and the profiler; the other has no code for either at all.
+ */
+static inline __attribute__((always_inline)) InterpretResult execute(bool observed) {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
@@ -263,33 +681,135 @@ static InterpretResult run() {
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
+#define READ_LONG() \
+    (frame->ip += 3, \
+    (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+
+/**
+ * For instructions that share a case with their _LONG form: reads a
+ * three-byte operand if the one executing is `longForm`, else one byte.
+ */
+#define READ_OPERAND(longForm) \
+    (instruction == (longForm) ? READ_LONG() : READ_BYTE())
+
+#define READ_STRING_OPERAND(longForm) \
+    AS_STRING(frame->closure->function->chunk.constants.values[ \
+        READ_OPERAND(longForm)])
+
+/**
+ * Bumps the feedback counter of the instruction being executed and, once it
+ * is warm, rewrites its opcode to `specialized`. Shared code is read-only
+ * and stays generic. Must run before anything
+ * else reads from frame->ip, since the counter is the next byte.
+ */
+#define QUICKEN(specialized) \
+    do { \
+        if (frame->closure->function->chunk.shared == NULL && \
+            ++frame->ip[0] >= QUICKEN_THRESHOLD) { \
+            frame->ip[-1] = specialized; \
+        } \
+        frame->ip++; \
+    } while (false)
+
+/**
+ * Undoes a quickening whose type guard just failed: restores the generic
+ * opcode, resets the counter and re-dispatches the instruction so that the
+ * generic form handles (or reports) the operands.
+ */
+#define DEOPTIMIZE(generic) \
+    do { \
+        frame->ip[-1] = generic; \
+        frame->ip[0] = 0; \
+        frame->ip--; \
+    } while (false)
+
+#define BINARY_OP(valueType, op, specialized) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtimeError("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
+        QUICKEN(specialized); \
         double b = AS_NUMBER(pop()); \
         double a = AS_NUMBER(pop()); \
         push(valueType(a op b)); \
     } while (false)
 
+/**
+ * Register forms read their left operand from a local slot and their right
+ * operand through `right`, so no values pass through the stack.
+ */
+#define REGISTER_OP(valueType, op, right) \
+    do { \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = right; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        push(valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+    } while (false)
+
+#define REGISTER_STORE_OP(op, right) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = frame->slots[READ_BYTE()]; \
+        Value b = right; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        frame->slots[dest] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+/**
+ * The specialized forms only guard the operand types and write the result
+ * over the left operand in place. They skip the feedback byte untouched.
+ */
+#define NUMBER_OP(valueType, op, generic) \
+    do { \
+        Value b = vm.stackTop[-1]; \
+        Value a = vm.stackTop[-2]; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            DEOPTIMIZE(generic); \
+            break; \
+        } \
+        frame->ip++; \
+        vm.stackTop--; \
+        vm.stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+        if (debugOptions.traceExecution) {
+            printf("          ");
+            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+                printf("[ ");
+                printValue(*slot);
+                printf(" ]");
+            }
+            printf("\n");
+            disassembleInstruction(&frame->closure->function->chunk,
+                (int)(frame->ip - frame->closure->function->chunk.code));
         }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
+#ifdef INSTRUMENT_OPCODES
+        vm.opcodeCounts[*frame->ip]++;
+#endif
+        if (observed) {
+            ObjFunction* function = frame->closure->function;
+            int offset = (int)(frame->ip - function->chunk.code);
+            if (tracing()) {
+                traceInstruction(function, offset, vm.frameCount,
+                                 (int)(vm.stackTop - vm.stack));
+            }
+            if (profiling()) profileInstruction(function, offset);
+        }
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
@@ -297,6 +817,9 @@ static InterpretResult run() {
                 push(constant);
                 break;
             }
+            case OP_CONSTANT_LONG:
+                push(frame->closure->function->chunk.constants.values[READ_LONG()]);
+                break;
             case OP_NIL: push(NIL_VAL); break;
             case OP_TRUE: push(BOOL_VAL(true)); break;
             case OP_FALSE: push(BOOL_VAL(false)); break;
@@ -306,13 +829,20 @@ static InterpretResult run() {
                 push(frame->slots[slot]);
                 break;
             }
+            case OP_GET_LOCAL_LONG:
+                push(frame->slots[READ_LONG()]);
+                break;
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 frame->slots[slot] = peek(0);
                 break;
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
+            case OP_SET_LOCAL_LONG:
+                frame->slots[READ_LONG()] = peek(0);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_OPERAND(OP_GET_GLOBAL_LONG);
                 Value value;
                 if (!tableGet(&vm.globals, name, &value)) {
                     runtimeError("Undefined variable '%s'.", name->chars);
@@ -321,39 +851,46 @@ static InterpretResult run() {
                 push(value);
                 break;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_OPERAND(OP_DEFINE_GLOBAL_LONG);
                 tableSet(&vm.globals, name, peek(0));
+                vm.globalsChanged = true;
                 pop();
                 break;
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_OPERAND(OP_SET_GLOBAL_LONG);
                 if (tableSet(&vm.globals, name, peek(0))) {
                     tableDelete(&vm.globals, name);
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                vm.globalsChanged = true;
                 break;
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
+            case OP_GET_UPVALUE:
+            case OP_GET_UPVALUE_LONG: {
+                uint32_t slot = READ_OPERAND(OP_GET_UPVALUE_LONG);
                 push(*frame->closure->upvalues[slot]->location);
                 break;
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
+            case OP_SET_UPVALUE:
+            case OP_SET_UPVALUE_LONG: {
+                uint32_t slot = READ_OPERAND(OP_SET_UPVALUE_LONG);
                 *frame->closure->upvalues[slot]->location = peek(0);
                 break;
             }
-            case OP_GET_PROPERTY: {
+            case OP_GET_PROPERTY:
+            case OP_GET_PROPERTY_LONG: {
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
                 return INTERPRET_RUNTIME_ERROR;
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+                ObjString* name = READ_STRING_OPERAND(OP_GET_PROPERTY_LONG);
 
                 Value value;
                 if (tableGet(&instance->fields, name, &value)) {
@@ -367,21 +904,24 @@ static InterpretResult run() {
                 }
                 break;
             }
-            case OP_SET_PROPERTY: {
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_LONG: {
                 if (!IS_INSTANCE(peek(1))) {
                     runtimeError("Only instances have fields.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                tableSet(&instance->fields,
+                         READ_STRING_OPERAND(OP_SET_PROPERTY_LONG), peek(0));
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
+            case OP_GET_SUPER:
+            case OP_GET_SUPER_LONG: {
+                ObjString* name = READ_STRING_OPERAND(OP_GET_SUPER_LONG);
                 ObjClass* superclass = AS_CLASS(pop());
 
                 if (!bindMethod(superclass, name)) {
@@ -389,19 +929,55 @@ static InterpretResult run() {
                 }
                 break;
             }
+            case OP_GET_INDEX: {
+                if (!IS_LIST(peek(1))) {
+                    runtimeError("Only lists can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                ObjList* list = AS_LIST(peek(1));
+                int index;
+                if (!listIndex(list, peek(0), &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop -= 2;
+                push(list->items.values[index]);
+                break;
+            }
+            case OP_SET_INDEX: {
+                if (!IS_LIST(peek(2))) {
+                    runtimeError("Only lists can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
 
+                ObjList* list = AS_LIST(peek(2));
+                int index;
+                if (!listIndex(list, peek(1), &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = pop();
+                list->items.values[index] = value;
+                if (list->imageId == vm.globalsImageId) {
+                    vm.globalsChanged = true;
+                }
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
             case OP_EQUAL: {
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, > ); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, < ); break;
+            case OP_GREATER:  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); break;
+            case OP_LESS:     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); break;
             case OP_ADD: {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    QUICKEN(OP_ADD_STR);
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_ADD_NUM);
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
@@ -411,9 +987,76 @@ static InterpretResult run() {
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, / ); break;
+            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); break;
+            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); break;
+            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); break;
+            case OP_GREATER_NUM:  NUMBER_OP(BOOL_VAL, >, OP_GREATER); break;
+            case OP_LESS_NUM:     NUMBER_OP(BOOL_VAL, <, OP_LESS); break;
+            case OP_ADD_NUM:      NUMBER_OP(NUMBER_VAL, +, OP_ADD); break;
+            case OP_SUBTRACT_NUM: NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); break;
+            case OP_MULTIPLY_NUM: NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); break;
+            case OP_DIVIDE_NUM:   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); break;
+            case OP_ADD_STR: {
+                if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                    DEOPTIMIZE(OP_ADD);
+                    break;
+                }
+                frame->ip++;
+                concatenate();
+                break;
+            }
+            case OP_ADD_LL:
+            case OP_ADD_LK: {
+                Value a = frame->slots[READ_BYTE()];
+                Value b = instruction == OP_ADD_LL
+                    ? frame->slots[READ_BYTE()] : READ_CONSTANT();
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    push(a);
+                    push(b);
+                    concatenate();
+                } else {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SUBTRACT_LL: REGISTER_OP(NUMBER_VAL, -, frame->slots[READ_BYTE()]); break;
+            case OP_SUBTRACT_LK: REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT()); break;
+            case OP_MULTIPLY_LL: REGISTER_OP(NUMBER_VAL, *, frame->slots[READ_BYTE()]); break;
+            case OP_MULTIPLY_LK: REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT()); break;
+            case OP_DIVIDE_LL:   REGISTER_OP(NUMBER_VAL, /, frame->slots[READ_BYTE()]); break;
+            case OP_DIVIDE_LK:   REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT()); break;
+            case OP_LESS_LL:     REGISTER_OP(BOOL_VAL, <, frame->slots[READ_BYTE()]); break;
+            case OP_LESS_LK:     REGISTER_OP(BOOL_VAL, <, READ_CONSTANT()); break;
+            case OP_GREATER_LL:  REGISTER_OP(BOOL_VAL, >, frame->slots[READ_BYTE()]); break;
+            case OP_GREATER_LK:  REGISTER_OP(BOOL_VAL, >, READ_CONSTANT()); break;
+            case OP_ADD_LLL:
+            case OP_ADD_LLK: {
+                uint8_t dest = READ_BYTE();
+                Value a = frame->slots[READ_BYTE()];
+                Value b = instruction == OP_ADD_LLL
+                    ? frame->slots[READ_BYTE()] : READ_CONSTANT();
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    frame->slots[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    push(a);
+                    push(b);
+                    concatenate();
+                    frame->slots[dest] = pop();
+                } else {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SUBTRACT_LLL: REGISTER_STORE_OP(-, frame->slots[READ_BYTE()]); break;
+            case OP_SUBTRACT_LLK: REGISTER_STORE_OP(-, READ_CONSTANT()); break;
+            case OP_MULTIPLY_LLL: REGISTER_STORE_OP(*, frame->slots[READ_BYTE()]); break;
+            case OP_MULTIPLY_LLK: REGISTER_STORE_OP(*, READ_CONSTANT()); break;
+            case OP_DIVIDE_LLL:   REGISTER_STORE_OP(/, frame->slots[READ_BYTE()]); break;
+            case OP_DIVIDE_LLK:   REGISTER_STORE_OP(/, READ_CONSTANT()); break;
             case OP_NOT:
                 push(BOOL_VAL(isFalsey(pop())));
                 break;
@@ -430,12 +1073,12 @@ static InterpretResult run() {
                 break;
             }
             case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
+                uint32_t offset = READ_LONG();
                 frame->ip += offset;
                 break;
             }
             case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
+                uint32_t offset = READ_LONG();
                 if (isFalsey(peek(0))) frame->ip += offset;
                 break;
             }
@@ -444,16 +1087,89 @@ static InterpretResult run() {
                 frame->ip -= offset;
                 break;
             }
+            case OP_LOOP_LONG: {
+                uint32_t offset = READ_LONG();
+                frame->ip -= offset;
+                break;
+            }
+            case OP_FOR_PREP: {
+                Value sequence = peek(0);
+                if (IS_RANGE(sequence) || IS_LIST(sequence) ||
+                    IS_STRING(sequence)) {
+                    push(NUMBER_VAL(-1));
+                } else {
+                    runtimeError("Can only iterate over lists, ranges and strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(NIL_VAL); // The loop variable.
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_LONG: {
+                // slots[0] is the sequence, slots[1] the index and slots[2]
+                // the loop variable. See forInStatement() in compiler.c.
+                Value* slots = frame->slots + READ_OPERAND(OP_FOR_LOOP_LONG);
+                uint32_t offset = instruction == OP_FOR_LOOP_LONG
+                    ? READ_LONG() : READ_SHORT();
+                Obj* sequence = AS_OBJ(slots[0]);
+                double next = AS_NUMBER(slots[1]) + 1;
+
+                switch (sequence->type) {
+                    case OBJ_RANGE: {
+                        ObjRange* range = (ObjRange*)sequence;
+                        double value = range->start + next;
+                        if (value >= range->end) break;
+                        slots[1] = NUMBER_VAL(next);
+                        slots[2] = NUMBER_VAL(value);
+                        frame->ip -= offset;
+                        break;
+                    }
+                    case OBJ_LIST: {
+                        ObjList* list = (ObjList*)sequence;
+                        if (next >= list->items.count) break;
+                        slots[1] = NUMBER_VAL(next);
+                        slots[2] = list->items.values[(int)next];
+                        frame->ip -= offset;
+                        break;
+                    }
+                    case OBJ_STRING: {
+                        ObjString* string = (ObjString*)sequence;
+                        if (next >= string->length) break;
+                        slots[1] = NUMBER_VAL(next);
+                        slots[2] = OBJ_VAL(copyString(string->chars + (int)next, 1));
+                        frame->ip -= offset;
+                        break;
+                    }
+                    default:
+                        break; // Unreachable. OP_FOR_PREP checked the type.
+                }
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
+                Value callee = peek(argCount);
+                // Calls into C are hot enough to skip callValue()'s switch.
+                if (IS_NATIVE(callee)) {
+                    if (!callNative(AS_NATIVE(callee), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else if (!callValue(callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                if (!tailCallValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+            case OP_INVOKE:
+            case OP_INVOKE_LONG: {
+                ObjString* method = READ_STRING_OPERAND(OP_INVOKE_LONG);
                 int argCount = READ_BYTE();
                 if (!invoke(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
@@ -461,8 +1177,9 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
+            case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG: {
+                ObjString* method = READ_STRING_OPERAND(OP_SUPER_INVOKE_LONG);
                 int argCount = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(pop());
                 if (!invokeFromClass(superclass, method, argCount)) {
@@ -471,13 +1188,16 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG: {
+                ObjFunction* function = AS_FUNCTION(
+                    frame->closure->function->chunk.constants.values[
+                        READ_OPERAND(OP_CLOSURE_LONG)]);
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                    uint32_t index = READ_OPERAND(OP_CLOSURE_LONG);
                     if (isLocal) {
                         closure->upvalues[i] =
                             captureUpvalue(frame->slots + index);
@@ -488,6 +1208,19 @@ static InterpretResult run() {
 
                 break;
             }
+            case OP_YIELD: {
+                if (vm.fiber->caller == NULL) {
+                    runtimeError("Can't yield from the main fiber.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (vm.fiber->nativeCalls > 0) {
+                    runtimeError("Can't yield inside a call made by a native.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                leaveFiber(pop(), false);
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
             case OP_CLOSE_UPVALUE:
                 closeUpvalues(vm.stackTop - 1);
                 pop();
@@ -497,8 +1230,25 @@ static InterpretResult run() {
                 closeUpvalues(frame->slots);
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+                    if (vm.fiber->caller != NULL) {
+                        // A fiber's function returned.
+                        vm.stackTop = vm.stack;
+                        leaveFiber(result, true);
+                        frame = &vm.frames[vm.frameCount - 1];
+                        break;
+                    }
+                    if (vm.fiber == vm.mainFiber) {
+                        // Left for whoever started run() to pop.
+                        vm.stackTop = vm.stack;
+                        push(result);
+                    } else {
+                        // A scheduled task finished.
+                        vm.stackTop = vm.stack;
+                        vm.fiber->state = FIBER_DONE;
+                    }
+                    if (!runNextTask()) return INTERPRET_OK;
+                    frame = &vm.frames[vm.frameCount - 1];
+                    break;
                 }
 
                 vm.stackTop = frame->slots;
@@ -506,8 +1256,17 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
+            case OP_EXIT: {
+                // The call nativeCall() made has returned to vm.nativeCall.
+                Value result = pop();
+                vm.frameCount--;
+                vm.stackTop = frame->slots;
+                push(result);
+                return INTERPRET_OK;
+            }
             case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
+            case OP_CLASS_LONG:
+                push(OBJ_VAL(newClass(READ_STRING_OPERAND(OP_CLASS_LONG))));
                 break;
             case OP_INHERIT: {
                 Value superclass = peek(1);
@@ -523,16 +1282,64 @@ static InterpretResult run() {
                 break;
             }
             case OP_METHOD:
-                defineMethod(READ_STRING());
+            case OP_METHOD_LONG:
+                defineMethod(READ_STRING_OPERAND(OP_METHOD_LONG));
+                break;
+            case OP_BUILD_LIST: {
+                int itemCount = READ_BYTE();
+                // Keep the list on the stack so the GC can see it while
+                // its item array grows.
+                ObjList* list = newList();
+                push(OBJ_VAL(list));
+                for (int i = itemCount; i > 0; i--) {
+                    writeValueArray(&list->items, peek(i));
+                }
+                vm.stackTop -= itemCount + 1;
+                push(OBJ_VAL(list));
+                break;
+            }
+            case OP_RANGE: {
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    runtimeError("Range bounds must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                double end = AS_NUMBER(pop());
+                double start = AS_NUMBER(pop());
+                push(OBJ_VAL(newRange(start, end)));
                 break;
+            }
         }
     }
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_OPERAND
+#undef READ_STRING_OPERAND
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef REGISTER_OP
+#undef REGISTER_STORE_OP
+}
+
+static InterpretResult run() {
+    return tracing() || profiling() ? execute(true) : execute(false);
+}
+
+static InterpretResult runScript(ObjFunction* function) {
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    call(closure, 0);
+
+    InterpretResult result = run();
+    if (result == INTERPRET_OK) pop();
+    return result;
 }
 
 /**
@@ -547,11 +1354,64 @@ InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+    return runScript(function);
+}
 
-    return run();
-}
\ No newline at end of file
+/**
+ * Runs a script compiled with compileShared(), possibly on another thread.
+ * Only the constants are materialized in this VM; the bytecode is shared.
+ */
+InterpretResult interpretShared(SharedCode* code) {
+    return runScript(loadSharedCode(code));
+}
+
+/**
+ * Calls the function below the `argCount` arguments on top of the stack
+ * and stores what it returns in `result`. This is how a worker thread runs
+ * the function it was spawned with.
+ */
+InterpretResult interpretCall(int argCount, Value* result) {
+    if (!callValue(peek(argCount), argCount)) return INTERPRET_RUNTIME_ERROR;
+
+    InterpretResult status = run();
+    if (status == INTERPRET_OK) *result = pop();
+    return status;
+}
+
+/**
+ * Starts a nested run() above the native's frame. vm.nativeCall's frame
+ * goes in first, so once the callee returns the next instruction is its
+ * OP_EXIT, which ends that run() and leaves the result on top.
+ */
+bool nativeCall(Value callee, int argCount, Value* args, Value* result) {
+    // Room for vm.nativeCall's frame, the callee and the arguments, made
+    // before anything is pushed: `args` may point into the stack.
+    bool argsOnStack = args >= vm.stack && args < vm.stackTop;
+    ptrdiff_t argsOffset = argsOnStack ? args - vm.stack : 0;
+    ensureStack(vm.nativeCall->function->slotCount + STACK_SLACK +
+                argCount + 1);
+    if (argsOnStack) args = vm.stack + argsOffset;
+
+    push(OBJ_VAL(vm.nativeCall));
+    bool ok = call(vm.nativeCall, 0);
+    if (ok) {
+        push(callee);
+        for (int i = 0; i < argCount; i++) push(args[i]);
+
+        ObjNative* native = vm.native;
+        ObjFiber* fiber = vm.fiber;
+        fiber->nativeCalls++;
+        ok = callValue(callee, argCount) && run() == INTERPRET_OK;
+        fiber->nativeCalls--;
+        vm.native = native;
+    }
+
+    if (!ok) {
+        // Reported by runtimeError(), which also reset the stack.
+        vm.nativeFailed = true;
+        vm.nativeCallFailed = true;
+        return false;
+    }
+    *result = pop();
+    return true;
+}
@@ -1,35 +1,86 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <signal.h>
+
+#include "io.h"
+#include "native.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/**
+ * The call stack and the value stack live on the heap. They start small and
+ * double whenever a call needs more room, up to vm.framesMax frames. That
+ * limit defaults to FRAMES_MAX and can be changed after initVM().
+ */
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 10000
+#endif
+#define FRAMES_INITIAL 8
+// Room kept above every frame's slots for what the natives it calls push,
+// and for instructions that push a value before they pop their operands.
+#define STACK_SLACK 8
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
 
-typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip;
-    Value* slots;
-} CallFrame;
+// Fibers are often short generators, so they start with less room than
+// the main fiber. Any fiber grows the same way when it needs to.
+#define FIBER_FRAMES_INITIAL 2
+#define FIBER_STACK_INITIAL (2 * UINT8_COUNT)
 
+/**
+ * frames, stack and openUpvalues always belong to the fiber that is
+ * running, vm.fiber. They are copied out into the fiber when it suspends
+ * and loaded from the next one when it resumes, so run() never has to
+ * go through the fiber to reach them.
+ */
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  ObjFiber* fiber;
+  // The fiber that runs the script. Control returns here when it's over.
+  ObjFiber* mainFiber;
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
+  int framesMax;
+  // Set while `frames` is being replaced, for the sampling profiler's
+  // signal handler. See sample.h.
+  volatile sig_atomic_t framesChanging;
 
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
   Table globals;
+  // The globals as spawn() last froze them, and whether they may have
+  // changed since. See worker.h. Images are numbered from 1.
+  GlobalsImage* globalsImage;
+  int globalsImageId;
+  bool globalsChanged;
   Table strings;
   ObjString* initString;
-  ObjUpvalue* openUpvalues;
+  ObjUpvalue** openUpvalues;
+  int openUpvalueTop;
+  ObjFiber* fibers;
+  Loop loop;
+  // The native being called, and the error it raised, if any.
+  ObjNative* native;
+  bool nativeFailed;
+  char nativeMessage[NATIVE_ERROR_MAX];
+  // Set when the error was raised in a call made by nativeCall() and has
+  // been reported already.
+  bool nativeCallFailed;
+  // Sits below every call made by nativeCall(). Its one OP_EXIT returns
+  // from the run() that nativeCall() started.
+  ObjClosure* nativeCall;
   size_t bytesAllocated;
   size_t nextGC;
   Obj* objects;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+#ifdef INSTRUMENT_OPCODES
+  // How many times each opcode has been dispatched.
+  uint64_t opcodeCounts[OPCODE_COUNT];
+#endif
 } VM;
 
 typedef enum {
@@ -38,12 +89,19 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// The calling thread's VM. See THREAD_LOCAL in common.h.
+extern THREAD_LOCAL VM vm;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* chunk);
+InterpretResult interpretShared(SharedCode* code);
+InterpretResult interpretCall(int argCount, Value* result);
+void ensureStack(int needed);
 void push(Value value);
 Value pop();
+#ifdef INSTRUMENT_OPCODES
+void printOpcodeCounts();
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,566 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "memory.h"
+#include "native.h"
+#include "vm.h"
+#include "worker.h"
+
+#define TRANSFER_ERROR "Can't pass that value to another thread."
+
+// Lists nested deeper than this, including any list that contains itself,
+// can't be transferred.
+#define TRANSFER_DEPTH_MAX 64
+
+/**
+ * Transfers, channels and workers are shared between threads, so like
+ * SharedCode they are allocated outside every VM's heap.
+ */
+static void* allocateTransfer(size_t size) {
+    if (size == 0) return NULL;
+    void* result = malloc(size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void retainChannel(Channel* channel) {
+    atomic_fetch_add_explicit(&channel->refCount, 1, memory_order_relaxed);
+}
+
+static void freeTransfer(Transfer* transfer) {
+    switch (transfer->type) {
+        case TRANSFER_STRING:
+            free(transfer->as.string.chars);
+            break;
+        case TRANSFER_LIST:
+            for (int i = 0; i < transfer->as.list.count; i++) {
+                freeTransfer(&transfer->as.list.items[i]);
+            }
+            free(transfer->as.list.items);
+            break;
+        case TRANSFER_FUNCTION:
+            releaseSharedCode(transfer->as.function);
+            break;
+        case TRANSFER_CHANNEL:
+            releaseChannel(transfer->as.channel);
+            break;
+        default:
+            break;
+    }
+    transfer->type = TRANSFER_NIL;
+}
+
+/**
+ * Returns false, leaving `transfer` nil, if `value` can't be transferred.
+ * Lists frozen into the current globals image are tagged with its id when
+ * `image` is set.
+ */
+static bool freezeValue(Value value, Transfer* transfer, int depth,
+                        bool image) {
+    transfer->type = TRANSFER_NIL;
+    if (IS_NIL(value)) return true;
+    if (IS_BOOL(value)) {
+        transfer->type = TRANSFER_BOOL;
+        transfer->as.boolean = AS_BOOL(value);
+        return true;
+    }
+    if (IS_NUMBER(value)) {
+        transfer->type = TRANSFER_NUMBER;
+        transfer->as.number = AS_NUMBER(value);
+        return true;
+    }
+    if (depth == TRANSFER_DEPTH_MAX) return false;
+
+    switch (OBJ_TYPE(value)) {
+        case OBJ_STRING: {
+            ObjString* string = AS_STRING(value);
+            transfer->type = TRANSFER_STRING;
+            transfer->as.string.length = string->length;
+            transfer->as.string.chars = allocateTransfer(string->length);
+            memcpy(transfer->as.string.chars, string->chars, string->length);
+            return true;
+        }
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            ValueArray* items = &list->items;
+            if (image) list->imageId = vm.globalsImageId;
+            transfer->type = TRANSFER_LIST;
+            transfer->as.list.count = 0;
+            transfer->as.list.items =
+                allocateTransfer(sizeof(Transfer) * items->count);
+            for (int i = 0; i < items->count; i++) {
+                if (!freezeValue(items->values[i], &transfer->as.list.items[i],
+                                 depth + 1, image)) {
+                    freeTransfer(transfer);
+                    return false;
+                }
+                transfer->as.list.count++;
+            }
+            return true;
+        }
+        case OBJ_RANGE:
+            transfer->type = TRANSFER_RANGE;
+            transfer->as.range.start = AS_RANGE(value)->start;
+            transfer->as.range.end = AS_RANGE(value)->end;
+            return true;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = AS_CLOSURE(value);
+            if (closure->upvalueCount > 0) return false;
+            transfer->type = TRANSFER_FUNCTION;
+            transfer->as.function = shareFunction(closure->function);
+            return true;
+        }
+        case OBJ_CHANNEL:
+            transfer->type = TRANSFER_CHANNEL;
+            transfer->as.channel = AS_CHANNEL(value)->channel;
+            retainChannel(transfer->as.channel);
+            return true;
+        case OBJ_NATIVE: {
+            // Natives are code and data of the process, not of a VM.
+            ObjNative* native = AS_NATIVE(value);
+            transfer->type = TRANSFER_NATIVE;
+            transfer->as.native.function = native->function;
+            transfer->as.native.arity = native->arity;
+            transfer->as.native.data = native->data;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Builds the value in the calling thread's VM. The transfer is untouched.
+static Value thawValue(Transfer* transfer) {
+    switch (transfer->type) {
+        case TRANSFER_NIL:
+            return NIL_VAL;
+        case TRANSFER_BOOL:
+            return BOOL_VAL(transfer->as.boolean);
+        case TRANSFER_NUMBER:
+            return NUMBER_VAL(transfer->as.number);
+        case TRANSFER_STRING:
+            return OBJ_VAL(copyString(transfer->as.string.chars,
+                                      transfer->as.string.length));
+        case TRANSFER_LIST: {
+            // Nested lists push a level at a time, past any frame's slack.
+            ensureStack(2);
+            ObjList* list = newList();
+            push(OBJ_VAL(list));
+            for (int i = 0; i < transfer->as.list.count; i++) {
+                Value item = thawValue(&transfer->as.list.items[i]);
+                push(item);
+                writeValueArray(&list->items, item);
+                pop();
+            }
+            pop();
+            return OBJ_VAL(list);
+        }
+        case TRANSFER_RANGE:
+            return OBJ_VAL(newRange(transfer->as.range.start,
+                                    transfer->as.range.end));
+        case TRANSFER_FUNCTION: {
+            ObjFunction* function = loadSharedCode(transfer->as.function);
+            push(OBJ_VAL(function));
+            ObjClosure* closure = newClosure(function);
+            pop();
+            return OBJ_VAL(closure);
+        }
+        case TRANSFER_CHANNEL:
+            retainChannel(transfer->as.channel);
+            return OBJ_VAL(newChannel(transfer->as.channel));
+        case TRANSFER_NATIVE:
+            return OBJ_VAL(newNative(transfer->as.native.function,
+                                     transfer->as.native.arity,
+                                     transfer->as.native.data));
+    }
+    return NIL_VAL; // Unreachable.
+}
+
+void releaseChannel(Channel* channel) {
+    if (atomic_fetch_sub_explicit(&channel->refCount, 1,
+                                  memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    Message* message = channel->head;
+    while (message != NULL) {
+        Message* next = message->next;
+        freeTransfer(&message->value);
+        free(message);
+        message = next;
+    }
+    close(channel->fd);
+    pthread_mutex_destroy(&channel->lock);
+    free(channel);
+}
+
+// Channel() returns a new, empty channel.
+Value channelNative(int argCount, Value* args) {
+    (void)argCount;
+    (void)args;
+    int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) return nativeError("Channel() couldn't create an eventfd.");
+
+    Channel* channel = allocateTransfer(sizeof(Channel));
+    atomic_init(&channel->refCount, 1);
+    pthread_mutex_init(&channel->lock, NULL);
+    channel->fd = fd;
+    channel->head = NULL;
+    channel->tail = NULL;
+    return OBJ_VAL(newChannel(channel));
+}
+
+Value sendNative(int argCount, Value* args) {
+    (void)argCount;
+    if (!IS_CHANNEL(args[0])) return nativeError("send() takes a channel.");
+
+    Message* message = allocateTransfer(sizeof(Message));
+    if (!freezeValue(args[1], &message->value, 0, false)) {
+        free(message);
+        return nativeError(TRANSFER_ERROR);
+    }
+    message->next = NULL;
+
+    // The count is added under the lock, so a receiver that takes it waits
+    // there until the message is queued. The counter can't overflow: there
+    // isn't enough memory for that many messages.
+    Channel* channel = AS_CHANNEL(args[0])->channel;
+    pthread_mutex_lock(&channel->lock);
+    uint64_t one = 1;
+    if (write(channel->fd, &one, sizeof(one)) == -1) {
+        pthread_mutex_unlock(&channel->lock);
+        freeTransfer(&message->value);
+        free(message);
+        return nativeError("send() couldn't signal the channel.");
+    }
+    if (channel->tail == NULL) {
+        channel->head = message;
+    } else {
+        channel->tail->next = message;
+    }
+    channel->tail = message;
+    pthread_mutex_unlock(&channel->lock);
+    return NIL_VAL;
+}
+
+// receive(channel) returns the oldest value sent to the channel.
+Value receiveNative(int argCount, Value* args) {
+    if (!IS_CHANNEL(args[0])) return nativeError("receive() takes a channel.");
+
+    Channel* channel = AS_CHANNEL(args[0])->channel;
+    uint64_t count;
+    if (read(channel->fd, &count, sizeof(count)) == -1) {
+        if (errno == EAGAIN) {
+            return ioBlock(channel->fd, EPOLLIN, receiveNative, argCount, args);
+        }
+        return NIL_VAL;
+    }
+
+    // Taking a count guarantees there's a message for us.
+    pthread_mutex_lock(&channel->lock);
+    Message* message = channel->head;
+    channel->head = message->next;
+    if (channel->head == NULL) channel->tail = NULL;
+    pthread_mutex_unlock(&channel->lock);
+
+    Value value = thawValue(&message->value);
+    freeTransfer(&message->value);
+    free(message);
+    return value;
+}
+
+// Frees what the worker was started with, once it has been loaded.
+static void freeInputs(Worker* worker) {
+    freeTransfer(&worker->function);
+    for (int i = 0; i < worker->argCount; i++) {
+        freeTransfer(&worker->args[i]);
+    }
+    free(worker->args);
+    worker->args = NULL;
+    worker->argCount = 0;
+
+    if (worker->globals != NULL) releaseGlobalsImage(worker->globals);
+    worker->globals = NULL;
+}
+
+void releaseWorker(Worker* worker) {
+    if (atomic_fetch_sub_explicit(&worker->refCount, 1,
+                                  memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    freeInputs(worker);
+    freeTransfer(&worker->result);
+    close(worker->fd);
+    free(worker);
+}
+
+static void runWorker(Worker* worker) {
+    initVM();
+
+    for (int i = 0; i < worker->globals->count; i++) {
+        TransferGlobal* global = &worker->globals->globals[i];
+        push(OBJ_VAL(copyString(global->name, global->length)));
+        push(thawValue(&global->value));
+        tableSet(&vm.globals, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+        pop();
+        pop();
+    }
+
+    push(thawValue(&worker->function));
+    for (int i = 0; i < worker->argCount; i++) {
+        push(thawValue(&worker->args[i]));
+    }
+    int argCount = worker->argCount;
+    freeInputs(worker);
+
+    Value result;
+    worker->failed = interpretCall(argCount, &result) != INTERPRET_OK ||
+                     !freezeValue(result, &worker->result, 0, false);
+    freeVM();
+
+    atomic_store_explicit(&worker->done, true, memory_order_release);
+    uint64_t one = 1;
+    write(worker->fd, &one, sizeof(one));
+    releaseWorker(worker);
+}
+
+/**
+ * The pool runs at most one job per online CPU at a time; later jobs wait
+ * in the queue for a thread to become idle. A thread that waits in epoll,
+ * in join() or receive() for example, doesn't count toward that limit, and
+ * another thread is started for the queue while it waits. A worker that
+ * joins workers spawned after it therefore can't starve them. Idle threads
+ * stay in the pool for the next spawn() unless it has more than it can
+ * run at once.
+ */
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER;
+static Worker* jobHead = NULL;
+static Worker* jobTail = NULL;
+static int jobCount = 0;
+static int poolSize = 0;
+// Counted from just before a thread is created until it exits.
+static int threadCount = 0;
+static int idleThreads = 0;
+static int waitingThreads = 0;
+static THREAD_LOCAL bool inPool = false;
+
+// Called with poolLock held.
+static bool needThread() {
+    return idleThreads < jobCount && threadCount - waitingThreads < poolSize;
+}
+
+static void* poolThread(void* unused) {
+    (void)unused;
+    inPool = true;
+    pthread_mutex_lock(&poolLock);
+    for (;;) {
+        while (jobHead == NULL) {
+            if (threadCount - waitingThreads > poolSize) {
+                threadCount--;
+                pthread_mutex_unlock(&poolLock);
+                return NULL;
+            }
+            idleThreads++;
+            pthread_cond_wait(&poolWake, &poolLock);
+            idleThreads--;
+        }
+        Worker* worker = jobHead;
+        jobHead = worker->nextJob;
+        if (jobHead == NULL) jobTail = NULL;
+        jobCount--;
+
+        pthread_mutex_unlock(&poolLock);
+        runWorker(worker);
+        pthread_mutex_lock(&poolLock);
+    }
+}
+
+// The thread was counted by the caller. Returns false if it can't start.
+static bool startThread() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, poolThread, NULL) != 0) {
+        pthread_mutex_lock(&poolLock);
+        threadCount--;
+        pthread_mutex_unlock(&poolLock);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void beginPoolWait() {
+    if (!inPool) return;
+    pthread_mutex_lock(&poolLock);
+    waitingThreads++;
+    bool start = needThread();
+    if (start) threadCount++;
+    pthread_mutex_unlock(&poolLock);
+
+    // If this fails the queue waits for a thread to finish its job.
+    if (start) startThread();
+}
+
+void endPoolWait() {
+    if (!inPool) return;
+    pthread_mutex_lock(&poolLock);
+    waitingThreads--;
+    pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * Returns false, with the job no longer queued, if it needed a thread and
+ * none could be started.
+ */
+static bool submit(Worker* worker) {
+    pthread_mutex_lock(&poolLock);
+    if (poolSize == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        poolSize = cpus < 1 ? 1 : (int)cpus;
+    }
+    worker->nextJob = NULL;
+    if (jobTail == NULL) {
+        jobHead = worker;
+    } else {
+        jobTail->nextJob = worker;
+    }
+    jobTail = worker;
+    jobCount++;
+    bool start = needThread();
+    if (start) {
+        threadCount++;
+    } else {
+        pthread_cond_signal(&poolWake);
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (!start || startThread()) return true;
+
+    // A thread that became idle since may have taken the job already.
+    pthread_mutex_lock(&poolLock);
+    Worker* previous = NULL;
+    Worker* job = jobHead;
+    while (job != NULL && job != worker) {
+        previous = job;
+        job = job->nextJob;
+    }
+    if (job != NULL) {
+        if (previous == NULL) {
+            jobHead = job->nextJob;
+        } else {
+            previous->nextJob = job->nextJob;
+        }
+        if (jobTail == job) jobTail = previous;
+        jobCount--;
+    }
+    pthread_mutex_unlock(&poolLock);
+    return job == NULL;
+}
+
+void releaseGlobalsImage(GlobalsImage* image) {
+    if (atomic_fetch_sub_explicit(&image->refCount, 1,
+                                  memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    for (int i = 0; i < image->count; i++) {
+        free(image->globals[i].name);
+        freeTransfer(&image->globals[i].value);
+    }
+    free(image->globals);
+    free(image);
+}
+
+static GlobalsImage* freezeGlobals() {
+    Table* globals = &vm.globals;
+    vm.globalsImageId++;
+    GlobalsImage* image = allocateTransfer(sizeof(GlobalsImage));
+    atomic_init(&image->refCount, 1);
+    image->globals = allocateTransfer(sizeof(TransferGlobal) * globals->count);
+    image->count = 0;
+    for (int i = 0; i < globals->capacity; i++) {
+        Entry* entry = &globals->entries[i];
+        if (entry->key == NULL) continue;
+
+        TransferGlobal* global = &image->globals[image->count];
+        if (!freezeValue(entry->value, &global->value, 0, true)) continue;
+        global->length = entry->key->length;
+        global->name = allocateTransfer(entry->key->length);
+        memcpy(global->name, entry->key->chars, entry->key->length);
+        image->count++;
+    }
+    return image;
+}
+
+// Freezing every global is O(all of them), so it's done again only once
+// one of them may have changed.
+static GlobalsImage* currentGlobals() {
+    if (vm.globalsChanged) {
+        if (vm.globalsImage != NULL) releaseGlobalsImage(vm.globalsImage);
+        vm.globalsImage = freezeGlobals();
+        vm.globalsChanged = false;
+    }
+    atomic_fetch_add_explicit(&vm.globalsImage->refCount, 1,
+                              memory_order_relaxed);
+    return vm.globalsImage;
+}
+
+// spawn(fn, args...) returns a worker running `fn(args...)` on another thread.
+Value spawnNative(int argCount, Value* args) {
+    if (argCount < 1) {
+        return nativeError("Expected at least 1 argument but got 0.");
+    }
+    if (!IS_CLOSURE(args[0])) return nativeError("spawn() takes a function.");
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) return nativeError("spawn() couldn't create an eventfd.");
+
+    Worker* worker = allocateTransfer(sizeof(Worker));
+    atomic_init(&worker->refCount, 1);
+    worker->argCount = 0;
+    worker->args = allocateTransfer(sizeof(Transfer) * (argCount - 1));
+    worker->globals = NULL;
+    worker->failed = false;
+    worker->result.type = TRANSFER_NIL;
+    atomic_init(&worker->done, false);
+    worker->fd = fd;
+
+    bool ok = freezeValue(args[0], &worker->function, 0, false);
+    for (int i = 1; ok && i < argCount; i++) {
+        ok = freezeValue(args[i], &worker->args[i - 1], 0, false);
+        if (ok) worker->argCount++;
+    }
+    if (!ok) {
+        releaseWorker(worker);
+        return nativeError(TRANSFER_ERROR);
+    }
+    worker->globals = currentGlobals();
+
+    atomic_fetch_add_explicit(&worker->refCount, 1, memory_order_relaxed);
+    if (!submit(worker)) {
+        releaseWorker(worker);
+        releaseWorker(worker);
+        return nativeError("spawn() couldn't start a thread.");
+    }
+    return OBJ_VAL(newWorker(worker));
+}
+
+// join(worker) returns the worker's result, or nil if it failed.
+Value joinNative(int argCount, Value* args) {
+    if (!IS_WORKER(args[0])) return nativeError("join() takes a worker.");
+
+    Worker* worker = AS_WORKER(args[0])->worker;
+    if (!atomic_load_explicit(&worker->done, memory_order_acquire)) {
+        // The eventfd is never read, so it stays readable once signalled.
+        return ioBlock(worker->fd, EPOLLIN, joinNative, argCount, args);
+    }
+    if (worker->failed) return NIL_VAL;
+    return thawValue(&worker->result);
+}
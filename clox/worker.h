@@ -0,0 +1,130 @@
+#ifndef clox_worker_h
+#define clox_worker_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "object.h"
+#include "shared.h"
+
+/**
+ * spawn(fn, args...) runs `fn` on a pool thread in a VM of its own and
+ * returns a worker. The pool keeps about one thread running per CPU and
+ * queues the jobs beyond that. join(worker) waits for it and returns what
+ * `fn` returned, or nil if it failed. Channels carry values between workers:
+ * send(channel, value) never blocks and receive(channel) waits for the next
+ * value. Waiting in join() or receive() parks the fiber on the event loop,
+ * so other fibers keep running.
+ *
+ * No VM can see another's heap, so values cross threads as Transfers: deep,
+ * immutable copies in plain malloc'ed memory. nil, booleans, numbers,
+ * strings, lists, ranges, channels, natives and functions that don't
+ * capture any variables can be transferred. Functions travel as SharedCode
+ * images. Passing anything else is a runtime error.
+ *
+ * A worker starts with copies of the transferable globals of the VM that
+ * spawned it, so the functions it calls by name are there too, and so are
+ * natives loaded from extensions. Changes it makes to them stay in the
+ * worker. The globals are frozen into a GlobalsImage that every worker
+ * spawned after it shares, until the VM defines or assigns a global or
+ * stores into a list the image copied.
+ */
+
+typedef enum {
+    TRANSFER_NIL,
+    TRANSFER_BOOL,
+    TRANSFER_NUMBER,
+    TRANSFER_STRING,
+    TRANSFER_LIST,
+    TRANSFER_RANGE,
+    TRANSFER_FUNCTION,
+    TRANSFER_CHANNEL,
+    TRANSFER_NATIVE
+} TransferType;
+
+typedef struct Transfer {
+    TransferType type;
+    union {
+        bool boolean;
+        double number;
+        struct {
+            int length;
+            char* chars;
+        } string;
+        struct {
+            int count;
+            struct Transfer* items;
+        } list;
+        struct {
+            double start;
+            double end;
+        } range;
+        SharedCode* function;
+        Channel* channel;
+        struct {
+            NativeFn function;
+            int arity;
+            void* data;
+        } native;
+    } as;
+} Transfer;
+
+typedef struct Message {
+    Transfer value;
+    struct Message* next;
+} Message;
+
+struct Channel {
+    atomic_int refCount;
+    pthread_mutex_t lock;
+    // An eventfd semaphore counting the queued messages. A receiver takes
+    // one count before it takes a message, and waits on it when it's zero.
+    int fd;
+    Message* head;
+    Message* tail;
+};
+
+typedef struct {
+    int length;
+    char* name;
+    Transfer value;
+} TransferGlobal;
+
+struct GlobalsImage {
+    // One for the VM while it's current, one for each worker that hasn't
+    // loaded it yet.
+    atomic_int refCount;
+    int count;
+    TransferGlobal* globals;
+};
+
+struct Worker {
+    // One for the handle, one for the job until it finishes.
+    atomic_int refCount;
+    Transfer function;
+    int argCount;
+    Transfer* args;
+    GlobalsImage* globals;
+    // Written by the worker before it sets `done`.
+    bool failed;
+    Transfer result;
+    atomic_bool done;
+    // An eventfd that becomes readable once `done` is set.
+    int fd;
+    struct Worker* nextJob;
+};
+
+void releaseChannel(Channel* channel);
+void releaseGlobalsImage(GlobalsImage* image);
+void beginPoolWait();
+void endPoolWait();
+void releaseWorker(Worker* worker);
+
+Value spawnNative(int argCount, Value* args);
+Value joinNative(int argCount, Value* args);
+Value channelNative(int argCount, Value* args);
+Value sendNative(int argCount, Value* args);
+Value receiveNative(int argCount, Value* args);
+
+#endif
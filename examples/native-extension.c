@@ -0,0 +1,33 @@
+// An extension for `clox --native`. Build it with:
+//
+//   gcc -shared -fPIC -Iclox -o extension.so examples/native-extension.c -lm
+//   clox/main --native ./extension.so examples/native-extension.lox
+
+#include <math.h>
+
+#include "native.h"
+
+static Value hypotenuseNative(int argCount, Value* args) {
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        return nativeError("hypotenuse() takes two numbers.");
+    }
+    double a = AS_NUMBER(args[0]);
+    double b = AS_NUMBER(args[1]);
+    return NUMBER_VAL(sqrt(a * a + b * b));
+}
+
+// One function behind several natives, told apart by their user data.
+static Value scaleNative(int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) return nativeError("Can only scale a number.");
+    double factor = *(double*)nativeData();
+    return NUMBER_VAL(AS_NUMBER(args[0]) * factor);
+}
+
+static double twice = 2;
+static double tenfold = 10;
+
+void loxOpen(void) {
+    defineNative("hypotenuse", hypotenuseNative, 2, NULL);
+    defineNative("twice", scaleNative, 1, &twice);
+    defineNative("tenfold", scaleNative, 1, &tenfold);
+}